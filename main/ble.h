@@ -21,31 +21,12 @@
 
 #include "nimble/ble.h"
 #include "modlog/modlog.h"
+#include "codec.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-extern int8_t getSINT8(const uint8_t *data);
-extern int16_t getSINT16(const uint8_t *data);
-extern int32_t getSINT24(const uint8_t *data);
-extern int32_t getSINT32(const uint8_t *data);
-
-extern uint8_t getUINT8(const uint8_t *data);
-extern uint16_t getUINT16(const uint8_t *data);
-extern uint32_t getUINT24(const uint8_t *data);
-extern uint32_t getUINT32(const uint8_t *data);
-
-extern void putSINT8(uint8_t *data, int8_t value);
-extern void putSINT16(uint8_t *data, int16_t value);
-extern void putSINT24(uint8_t *data, int32_t value);
-extern void putSINT32(uint8_t *data, int32_t value);
-
-extern void putUINT8(uint8_t *data, uint8_t value);
-extern void putUINT16(uint8_t *data, uint16_t value);
-extern void putUINT24(uint8_t *data, uint32_t value);
-extern void putUINT32(uint8_t *data, uint32_t value);
-
 // Device Info Service
 #define GATT_DEVICE_INFO_UUID                   0x180A
 #define GATT_MANUFACTURER_NAME_UUID                 0x2A29  // READ
@@ -66,34 +47,91 @@ extern void putUINT32(uint8_t *data, uint32_t value);
 #define GATT_CYCLING_POWER_CONTROL_POINT_UUID       0x2a66  // WRITE,INDICATE
 #define GATT_SENSOR_LOCATION_UUID                   0x2a5d  // READ
 
-// Cycling Power Feature
-#define CPF_PEDAL_POWER_BALANCE                 0x00000001
-#define CPF_CRANK_REVOLUTION_DATA               0x00000008
-
-// Cycling Power Measurement
-#define CPM_INSTANT_POWER                       0x00000001
-#define CPM_PEDAL_POWER_BALANCE                 0x00000002
-#define CPM_CRANK_REVOLUTION_DATA               0x00000020
-
-struct CpmData {
-    uint8_t flags[2];
-    uint8_t instPower[2];
-    uint8_t pedalPowerBalance;
-    uint8_t cumulativeCrankRevolutions[2];
-    uint8_t lastCrankEventTime[2];
-} __attribute__((packed));
+// Simulation state
+extern void simSetTargetPower(uint16_t connHandle, int16_t targetPower, int64_t ctrlTag);
+extern void simSnapshot(struct SimState *state);
+
+// Notification subscriptions
+#define SUB_CPS_CPM                             0x0001
+#define SUB_CPS_PWR_VEC                         0x0002
+#define SUB_FEC2                                0x0004
+#define SUB_CPS_CP                              0x0008  // indications
+
+// ATT error returned by a control point write when the client has
+// not enabled its indications
+#define ATT_ERR_CCCD_IMPROPERLY_CONFIGURED      0xfd
+
+// Connected client
+struct Client {
+    uint16_t connHandle;    // BLE_HS_CONN_HANDLE_NONE if unused
+    uint32_t subs;          // SUB_xxx
+    uint32_t gen;           // bumped when its cumulative values restart
+    uint16_t cpmMask;       // CPM_MASK_xxx
+};
+
+extern void clientInit(void);
+extern void clientOpen(uint16_t connHandle);
+extern uint32_t clientClose(uint16_t connHandle);
+extern uint32_t clientSubscribe(uint16_t connHandle, uint32_t sub, bool enable);
+extern uint32_t clientGetSubs(uint16_t connHandle);
+extern bool clientRequestControl(uint16_t connHandle);
+extern bool clientFull(void);
+extern void clientSetCpmMask(uint16_t connHandle, uint16_t mask);
+extern void clientSnapshot(struct Client *snapshot);
+
+// Control-to-effect latency probe
+#define LATENCY_NUM_BUCKETS                     21      // 1us .. 1s+
+
+extern void latencyInit(void);
+extern void latencyConnOpen(uint16_t connHandle);
+extern void latencyConnClose(uint16_t connHandle);
+extern void latencyQueued(uint16_t connHandle, int64_t ctrlTag);
+extern void latencyHostTx(uint16_t connHandle);
+extern void latencyPrint(uint16_t connHandle);
+extern bool latencyCounts(uint16_t connHandle, uint32_t *queued, uint32_t *hostTx);
 
 extern uint16_t cpsCpmHandle;
+extern uint16_t cpsCpHandle;
 extern uint16_t cpsPwrVecHandle;
 extern uint16_t fec2ChrHandle;
 extern uint16_t fec3ChrHandle;
 
+// Longest device name that still fits in the advertising
+// data, after the flags, TX power level and CPS UUID fields.
+#define ADV_MAX_NAME_LEN                        19
+
 struct ble_hs_cfg;
 struct ble_gatt_register_ctxt;
+struct ble_gatt_svc_def;
+
+// Trainer personality, see personality.def
+struct Personality {
+    const char *name;
+    const char *deviceName;
+    const char *manufName;
+    const char *modelNum;
+    const char *serialNum;
+    const char *hardRev;
+    const char *firmRev;
+    uint32_t cpFeature;
+    const struct ble_gatt_svc_def *svcs;
+    int numSvcs;            // as listed in personality.def
+};
+
+extern const struct Personality personalities[];
+extern const int numPersonalities;
+
+// NVS key of the active personality index
+#define NVS_NAMESPACE                           "simTACX"
+#define NVS_KEY_PERSONALITY                     "personality"
+
+extern void cmdInit(const struct Personality *personality);
 
 void gatt_svr_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg);
 
-int gatt_svr_init(void);
+int personalityCheck(const struct Personality *p);
+
+int gatt_svr_init(const struct Personality *p);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,175 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "host/ble_hs.h"
+#include "ble.h"
+#include "sdkconfig.h"
+
+// Connected clients, updated by the NimBLE host task and read
+// by notifyTask through clientSnapshot(). At most one of them
+// is in control of the (shared) simulation; the others can
+// only change their own measurement view.
+static struct Client clients[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+static uint16_t ctrlConnHandle = BLE_HS_CONN_HANDLE_NONE;
+static portMUX_TYPE clientLock = portMUX_INITIALIZER_UNLOCKED;
+
+static struct Client *clientFind(uint16_t connHandle)
+{
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+        if (clients[i].connHandle == connHandle) {
+            return &clients[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Must be called with the lock held
+static uint32_t clientSubs(void)
+{
+    uint32_t subs = 0;
+
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+        if (clients[i].connHandle != BLE_HS_CONN_HANDLE_NONE) {
+            subs |= clients[i].subs;
+        }
+    }
+
+    return subs;
+}
+
+void clientOpen(uint16_t connHandle)
+{
+    taskENTER_CRITICAL(&clientLock);
+    struct Client *client = clientFind(BLE_HS_CONN_HANDLE_NONE);
+    if (client != NULL) {
+        uint32_t gen = client->gen;
+        memset(client, 0, sizeof(*client));
+        client->connHandle = connHandle;
+        client->gen = gen + 1;
+    }
+    taskEXIT_CRITICAL(&clientLock);
+}
+
+uint32_t clientClose(uint16_t connHandle)
+{
+    uint32_t subs;
+
+    taskENTER_CRITICAL(&clientLock);
+    struct Client *client = clientFind(connHandle);
+    if (client != NULL) {
+        client->connHandle = BLE_HS_CONN_HANDLE_NONE;
+    }
+    if (ctrlConnHandle == connHandle) {
+        ctrlConnHandle = BLE_HS_CONN_HANDLE_NONE;
+    }
+    subs = clientSubs();
+    taskEXIT_CRITICAL(&clientLock);
+
+    return subs;
+}
+
+uint32_t clientSubscribe(uint16_t connHandle, uint32_t sub, bool enable)
+{
+    uint32_t subs;
+
+    taskENTER_CRITICAL(&clientLock);
+    struct Client *client = clientFind(connHandle);
+    if (client != NULL) {
+        if (enable) {
+            // Restart the client's cumulative CPM values
+            if ((sub & SUB_CPS_CPM) && !(client->subs & SUB_CPS_CPM)) {
+                client->gen++;
+            }
+            client->subs |= sub;
+        } else {
+            client->subs &= ~sub;
+        }
+    }
+    subs = clientSubs();
+    taskEXIT_CRITICAL(&clientLock);
+
+    return subs;
+}
+
+uint32_t clientGetSubs(uint16_t connHandle)
+{
+    uint32_t subs = 0;
+
+    taskENTER_CRITICAL(&clientLock);
+    struct Client *client = clientFind(connHandle);
+    if (client != NULL) {
+        subs = client->subs;
+    }
+    taskEXIT_CRITICAL(&clientLock);
+
+    return subs;
+}
+
+bool clientRequestControl(uint16_t connHandle)
+{
+    bool granted = false;
+
+    taskENTER_CRITICAL(&clientLock);
+    if ((ctrlConnHandle == BLE_HS_CONN_HANDLE_NONE) && (clientFind(connHandle) != NULL)) {
+        ctrlConnHandle = connHandle;
+    }
+    granted = (ctrlConnHandle == connHandle);
+    taskEXIT_CRITICAL(&clientLock);
+
+    return granted;
+}
+
+// True if no other client can connect
+bool clientFull(void)
+{
+    taskENTER_CRITICAL(&clientLock);
+    bool full = (clientFind(BLE_HS_CONN_HANDLE_NONE) == NULL);
+    taskEXIT_CRITICAL(&clientLock);
+
+    return full;
+}
+
+void clientSetCpmMask(uint16_t connHandle, uint16_t mask)
+{
+    taskENTER_CRITICAL(&clientLock);
+    struct Client *client = clientFind(connHandle);
+    if (client != NULL) {
+        client->cpmMask = mask;
+    }
+    taskEXIT_CRITICAL(&clientLock);
+}
+
+void clientSnapshot(struct Client *snapshot)
+{
+    taskENTER_CRITICAL(&clientLock);
+    memcpy(snapshot, clients, sizeof(clients));
+    taskEXIT_CRITICAL(&clientLock);
+}
+
+void clientInit(void)
+{
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+        clients[i].connHandle = BLE_HS_CONN_HANDLE_NONE;
+    }
+}
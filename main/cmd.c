@@ -0,0 +1,107 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_console.h"
+#include "esp_sleep.h"
+#include "esp_system.h"
+#include "driver/uart.h"
+#include "nvs.h"
+#include "ble.h"
+#include "sdkconfig.h"
+
+static const struct Personality *activePersonality;
+
+/*
+ * personality            list the trainer personalities
+ * personality <name>     select one, store it in NVS and reboot
+ */
+static int cmdPersonality(int argc, char **argv)
+{
+    nvs_handle_t nvsHandle;
+    esp_err_t ret;
+    int index;
+
+    if (argc < 2) {
+        for (index = 0; index < numPersonalities; index++) {
+            printf("%c %d %s (%s)\n", (&personalities[index] == activePersonality) ? '*' : ' ',
+                    index, personalities[index].name, personalities[index].deviceName);
+        }
+        return 0;
+    }
+
+    for (index = 0; index < numPersonalities; index++) {
+        if (strcmp(argv[1], personalities[index].name) == 0) {
+            break;
+        }
+    }
+    if (index == numPersonalities) {
+        printf("Unknown personality \"%s\"\n", argv[1]);
+        return 1;
+    }
+
+    if ((ret = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvsHandle)) != ESP_OK) {
+        printf("Can't open NVS: %s\n", esp_err_to_name(ret));
+        return 1;
+    }
+    ret = nvs_set_u8(nvsHandle, NVS_KEY_PERSONALITY, index);
+    if (ret == ESP_OK) {
+        ret = nvs_commit(nvsHandle);
+    }
+    nvs_close(nvsHandle);
+    if (ret != ESP_OK) {
+        printf("Can't store personality: %s\n", esp_err_to_name(ret));
+        return 1;
+    }
+
+    printf("Restarting as %s...\n", personalities[index].name);
+    esp_restart();
+
+    return 0;
+}
+
+void cmdInit(const struct Personality *personality)
+{
+    esp_console_repl_t *repl = NULL;
+    esp_console_repl_config_t replConfig = ESP_CONSOLE_REPL_CONFIG_DEFAULT();
+    esp_console_dev_uart_config_t uartConfig = ESP_CONSOLE_DEV_UART_CONFIG_DEFAULT();
+    const esp_console_cmd_t personalityCmd = {
+        .command = "personality",
+        .help = "List the trainer personalities, or select one and reboot",
+        .hint = "[<name>]",
+        .func = &cmdPersonality,
+    };
+
+    activePersonality = personality;
+
+    replConfig.prompt = "simTACX>";
+    ESP_ERROR_CHECK(esp_console_new_repl_uart(&uartConfig, &replConfig, &repl));
+    ESP_ERROR_CHECK(esp_console_register_help_command());
+    ESP_ERROR_CHECK(esp_console_cmd_register(&personalityCmd));
+
+#if CONFIG_PM_ENABLE
+    // Let console input wake the chip up from light sleep
+    ESP_ERROR_CHECK(uart_set_wakeup_threshold(CONFIG_ESP_CONSOLE_UART_NUM, 3));
+    ESP_ERROR_CHECK(esp_sleep_enable_uart_wakeup(CONFIG_ESP_CONSOLE_UART_NUM));
+#endif
+
+    ESP_ERROR_CHECK(esp_console_start_repl(repl));
+}
@@ -0,0 +1,226 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include "codec.h"
+
+// GET signed values
+
+int8_t getSINT8(const uint8_t *data)
+{
+    uint8_t value = data[0];
+    return (int8_t) value;
+}
+
+int16_t getSINT16(const uint8_t *data)
+{
+    uint16_t value = ((uint16_t) data[1] << 8) | (uint16_t) data[0];
+    return (int16_t) value;
+}
+
+int32_t getSINT24(const uint8_t *data)
+{
+    uint32_t value = ((uint32_t) data[2] <<16) | ((uint32_t) data[1] << 8) | (uint32_t) data[0];
+    if (value & 0x00800000) {
+        value |= 0xff000000;    // sign extend
+    }
+    return (int32_t) value;
+}
+
+int32_t getSINT32(const uint8_t *data)
+{
+    uint32_t value = ((uint32_t) data[3] << 24) | ((uint32_t) data[2] <<16) | ((uint32_t) data[1] << 8) | (uint32_t) data[0];
+    return (int32_t) value;
+}
+
+// GET unsigned values
+
+uint8_t getUINT8(const uint8_t *data)
+{
+    uint8_t value = data[0];
+    return value;
+}
+
+uint16_t getUINT16(const uint8_t *data)
+{
+    uint16_t value = ((uint16_t) data[1] << 8) | (uint16_t) data[0];
+    return value;
+}
+
+uint32_t getUINT24(const uint8_t *data)
+{
+    uint32_t value = ((uint32_t) data[2] <<16) | ((uint32_t) data[1] << 8) | (uint32_t) data[0];
+    return value;
+}
+
+uint32_t getUINT32(const uint8_t *data)
+{
+    uint32_t value = ((uint32_t) data[3] << 24) | ((uint32_t) data[2] << 16) | ((uint32_t) data[1] << 8) | (uint32_t) data[0];
+    return value;
+}
+
+// PUT signed values
+
+void putSINT8(uint8_t *data, int8_t value)
+{
+    *data = (value & 0xff);
+}
+
+void putSINT16(uint8_t *data, int16_t value)
+{
+    *data++ = (value & 0xff);
+    *data = ((value >> 8) & 0xff);
+}
+
+void putSINT24(uint8_t *data, int32_t value)
+{
+    *data++ = (value & 0xff);
+    *data++ = ((value >> 8) & 0xff);
+    *data = ((value >> 16) & 0xff);
+}
+
+void putSINT32(uint8_t *data, int32_t value)
+{
+    *data++ = (value & 0xff);
+    *data++ = ((value >> 8) & 0xff);
+    *data++ = ((value >> 16) & 0xff);
+    *data = ((value >> 24) & 0xff);
+}
+
+// PUT unsigned values
+
+void putUINT8(uint8_t *data, uint8_t value)
+{
+    *data = value;
+}
+
+void putUINT16(uint8_t *data, uint16_t value)
+{
+    *data++ = (value & 0xff);
+    *data = ((value >> 8) & 0xff);
+}
+
+void putUINT24(uint8_t *data, uint32_t value)
+{
+    *data++ = (value & 0xff);
+    *data++ = ((value >> 8) & 0xff);
+    *data = ((value >> 16) & 0xff);
+}
+
+void putUINT32(uint8_t *data, uint32_t value)
+{
+    *data++ = (value & 0xff);
+    *data++ = ((value >> 8) & 0xff);
+    *data++ = ((value >> 16) & 0xff);
+    *data = ((value >> 24) & 0xff);
+}
+
+// Build a Cycling Power Measurement from the current
+// simulation state.
+void cpmEncode(struct CpmData *cpmData, struct CpmState *state, const struct SimState *sim)
+{
+    const uint16_t flags = CPM_PEDAL_POWER_BALANCE | CPM_PEDAL_POWER_BALANCE_REFERENCE | CPM_CRANK_REVOLUTION_DATA;
+    const uint8_t pedalPowerBalance = 100;  // 50%
+
+    // 2 revolutions in 1 sec (1024 ticks) = 120 RPM
+    state->cumulativeCrankRevolutions += 2;
+    state->lastCrankEventTime += 1024;
+
+    putUINT16(cpmData->flags, flags);
+    putSINT16(cpmData->instPower, sim->targetPower);
+    cpmData->pedalPowerBalance = pedalPowerBalance;
+    putUINT16(cpmData->cumulativeCrankRevolutions, state->cumulativeCrankRevolutions);
+    putUINT16(cpmData->lastCrankEventTime, state->lastCrankEventTime);
+}
+
+// Get the CPM content mask that hides the fields a device
+// with the given Cycling Power Feature bits does not support.
+uint16_t cpmFeatureMask(uint32_t cpFeature)
+{
+    uint16_t mask = 0;
+
+    if (!(cpFeature & CPF_PEDAL_POWER_BALANCE)) {
+        mask |= CPM_MASK_PEDAL_POWER_BALANCE;
+    }
+    if (!(cpFeature & CPF_CRANK_REVOLUTION_DATA)) {
+        mask |= CPM_MASK_CRANK_REVOLUTION_DATA;
+    }
+
+    return mask;
+}
+
+// Apply a client's view to a Cycling Power Measurement built
+// by cpmEncode(), which always has all the optional fields
+// present. The result is written to buf, which must be at
+// least sizeof (struct CpmData) bytes long. Returns its length.
+int cpmView(uint8_t *buf, const struct CpmData *cpmData, const struct CpmView *view)
+{
+    uint16_t flags = getUINT16(cpmData->flags);
+    uint8_t *data = buf + sizeof (cpmData->flags);
+
+    *data++ = cpmData->instPower[0];
+    *data++ = cpmData->instPower[1];
+
+    if (view->mask & CPM_MASK_PEDAL_POWER_BALANCE) {
+        flags &= ~(CPM_PEDAL_POWER_BALANCE | CPM_PEDAL_POWER_BALANCE_REFERENCE);
+    } else {
+        *data++ = cpmData->pedalPowerBalance;
+    }
+
+    if (view->mask & CPM_MASK_CRANK_REVOLUTION_DATA) {
+        flags &= ~CPM_CRANK_REVOLUTION_DATA;
+    } else {
+        putUINT16(data, getUINT16(cpmData->cumulativeCrankRevolutions) - view->crankRevOffset);
+        data += 2;
+        putUINT16(data, getUINT16(cpmData->lastCrankEventTime) - view->crankTimeOffset);
+        data += 2;
+    }
+
+    putUINT16(buf, flags);
+
+    return data - buf;
+}
+
+// Parse an FE-C message written to the fec3 characteristic,
+// and update the simulation state accordingly. Returns the
+// data page number, or -1 if this is not a valid FE-C data
+// message.
+int fecParse(const uint8_t *msg, uint16_t len, struct SimState *sim)
+{
+    uint8_t checksum = 0;
+
+    if ((len < FEC_MSG_LEN) || (msg[0] != FEC_SYNC) || (msg[1] != FEC_MSG_DATA_LEN) ||
+        ((msg[2] != FEC_MSG_ACKNOWLEDGED_DATA) && (msg[2] != FEC_MSG_BROADCAST_DATA))) {
+        return -1;
+    }
+
+    // The checksum is the XOR of all the preceding bytes
+    for (int i = 0; i < (FEC_MSG_LEN - 1); i++) {
+        checksum ^= msg[i];
+    }
+    if (checksum != msg[FEC_MSG_LEN - 1]) {
+        return -1;
+    }
+
+    if (msg[4] == FEC_PAGE_TARGET_POWER) {
+        // Target power is in units of 0.25W
+        sim->targetPower = getUINT16(&msg[10]) / 4;
+    }
+
+    return msg[4];
+}
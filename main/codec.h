@@ -0,0 +1,123 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Codec helpers and message encoders/decoders. Nothing in
+// here depends on NimBLE or FreeRTOS, so it builds on any
+// host as well as on the target.
+
+extern int8_t getSINT8(const uint8_t *data);
+extern int16_t getSINT16(const uint8_t *data);
+extern int32_t getSINT24(const uint8_t *data);
+extern int32_t getSINT32(const uint8_t *data);
+
+extern uint8_t getUINT8(const uint8_t *data);
+extern uint16_t getUINT16(const uint8_t *data);
+extern uint32_t getUINT24(const uint8_t *data);
+extern uint32_t getUINT32(const uint8_t *data);
+
+extern void putSINT8(uint8_t *data, int8_t value);
+extern void putSINT16(uint8_t *data, int16_t value);
+extern void putSINT24(uint8_t *data, int32_t value);
+extern void putSINT32(uint8_t *data, int32_t value);
+
+extern void putUINT8(uint8_t *data, uint8_t value);
+extern void putUINT16(uint8_t *data, uint16_t value);
+extern void putUINT24(uint8_t *data, uint32_t value);
+extern void putUINT32(uint8_t *data, uint32_t value);
+
+// Cycling Power Feature
+#define CPF_PEDAL_POWER_BALANCE                 0x00000001
+#define CPF_CRANK_REVOLUTION_DATA               0x00000008
+#define CPF_CONTENT_MASKING                     0x00000400
+
+// Cycling Power Measurement
+#define CPM_PEDAL_POWER_BALANCE                 0x00000001
+#define CPM_PEDAL_POWER_BALANCE_REFERENCE       0x00000002
+#define CPM_CRANK_REVOLUTION_DATA               0x00000020
+
+// Cycling Power Measurement content mask, as set through the
+// CPS control point
+#define CPS_CP_MASK_CPM_CONTENT                 0x0d    // op code
+#define CPM_MASK_PEDAL_POWER_BALANCE            0x0001
+#define CPM_MASK_CRANK_REVOLUTION_DATA          0x0008
+
+// Cycling Power Control Point response indication
+#define CPS_CP_RESPONSE_CODE                    0x20    // op code
+#define CPS_CP_SUCCESS                          0x01
+#define CPS_CP_OP_CODE_NOT_SUPPORTED            0x02
+#define CPS_CP_INVALID_PARAMETER                0x03
+#define CPS_CP_OPERATION_FAILED                 0x04
+
+struct CpmData {
+    uint8_t flags[2];
+    uint8_t instPower[2];
+    uint8_t pedalPowerBalance;
+    uint8_t cumulativeCrankRevolutions[2];
+    uint8_t lastCrankEventTime[2];
+} __attribute__((packed));
+
+// Crank revolution state carried across CPM notifications
+struct CpmState {
+    uint16_t cumulativeCrankRevolutions;
+    uint16_t lastCrankEventTime;    // 1/1024 sec
+};
+
+// Per-client view of the Cycling Power Measurement: the
+// content mask requested by the client, and the cumulative
+// values at the time it subscribed.
+struct CpmView {
+    uint16_t mask;                  // CPM_MASK_xxx
+    uint16_t crankRevOffset;
+    uint16_t crankTimeOffset;       // 1/1024 sec
+};
+
+// FE-C over BLE: ANT message carried in the fec3 characteristic
+#define FEC_SYNC                                0xa4
+#define FEC_MSG_BROADCAST_DATA                  0x4e
+#define FEC_MSG_ACKNOWLEDGED_DATA               0x4f
+#define FEC_MSG_LEN                             13      // sync, len, id, chan, 8 data bytes, checksum
+#define FEC_MSG_DATA_LEN                        9       // chan + 8 data bytes
+#define FEC_PAGE_TARGET_POWER                   0x31    // Data Page 49
+
+// Simulation state shared by the GATT access callbacks and
+// notifyTask. The control tag is the esp_timer time at which
+// the last control write arrived, or 0 if the current state
+// has already been reflected in a notification.
+struct SimState {
+    int16_t targetPower;    // Watts
+    uint16_t ctrlConn;      // connection that wrote the control
+    int64_t ctrlTag;        // usec
+};
+
+extern void cpmEncode(struct CpmData *cpmData, struct CpmState *state, const struct SimState *sim);
+extern uint16_t cpmFeatureMask(uint32_t cpFeature);
+extern int cpmView(uint8_t *buf, const struct CpmData *cpmData, const struct CpmView *view);
+extern int fecParse(const uint8_t *msg, uint16_t len, struct SimState *sim);
+
+#ifdef __cplusplus
+}
+#endif
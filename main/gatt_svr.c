@@ -25,14 +25,17 @@
 #include "services/gap/ble_svc_gap.h"
 #include "services/gatt/ble_svc_gatt.h"
 #include "services/ans/ble_svc_ans.h"
+#include "nimble/nimble_port.h"
+#include "esp_timer.h"
 #include "ble.h"
 #include "sdkconfig.h"
 
-static const char *manuf_name = "Garmin/Tacx";
-static const char *model_num = "FLUX 2";
-static const char *serial_num = "1234567890";
-static const char *hard_rev = "1";
-static const char *firm_rev = "0.0.0";
+// Const-qualified UUID compound literals, so that the GATT
+// tables below are placed in flash rather than in RAM.
+#define CONST_UUID16(uuid16) ((const ble_uuid_t *) (&(const ble_uuid16_t) BLE_UUID16_INIT(uuid16)))
+#define CONST_UUID128(...) ((const ble_uuid_t *) (&(const ble_uuid128_t) BLE_UUID128_INIT(__VA_ARGS__)))
+
+static const struct Personality *personality;
 
 static const char *chrOp[] = {
         [BLE_GATT_ACCESS_OP_READ_CHR] = "READ_CHR",
@@ -42,6 +45,7 @@ static const char *chrOp[] = {
 };
 
 uint16_t cpsCpmHandle;
+uint16_t cpsCpHandle;
 uint16_t cpsPwrVecHandle;
 uint16_t fec2ChrHandle;
 uint16_t fec3ChrHandle;
@@ -53,25 +57,91 @@ static int gatt_svr_chr_access_device_info(uint16_t connHandle, uint16_t attrHan
     uuid = ble_uuid_u16(ctxt->chr->uuid);
 
     if (uuid == GATT_MANUFACTURER_NAME_UUID) {
-        return (os_mbuf_append(ctxt->om, manuf_name, strlen(manuf_name)) == 0) ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+        return (os_mbuf_append(ctxt->om, personality->manufName, strlen(personality->manufName)) == 0) ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
     } else if (uuid == GATT_MODEL_NUMBER_UUID) {
-        return (os_mbuf_append(ctxt->om, model_num, strlen(model_num)) == 0) ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+        return (os_mbuf_append(ctxt->om, personality->modelNum, strlen(personality->modelNum)) == 0) ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
     } else if (uuid == GATT_SERIAL_NUMBER_UUID) {
-        return (os_mbuf_append(ctxt->om, serial_num, strlen(serial_num)) == 0) ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+        return (os_mbuf_append(ctxt->om, personality->serialNum, strlen(personality->serialNum)) == 0) ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
     } else if (uuid == GATT_HARDWARE_REVISION_UUID) {
-        return (os_mbuf_append(ctxt->om, hard_rev, strlen(hard_rev)) == 0) ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+        return (os_mbuf_append(ctxt->om, personality->hardRev, strlen(personality->hardRev)) == 0) ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
     } else if (uuid == GATT_FIRMWARE_REVISION_UUID) {
-        return (os_mbuf_append(ctxt->om, firm_rev, strlen(firm_rev)) == 0) ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+        return (os_mbuf_append(ctxt->om, personality->firmRev, strlen(personality->firmRev)) == 0) ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
     }
 
     assert(0);
     return BLE_ATT_ERR_UNLIKELY;
 }
 
+// Control point responses waiting to be indicated. They are
+// sent from the NimBLE host task's event queue, so that each of
+// them goes out after the response to the write that caused it.
+struct CpsCpResponse {
+    uint16_t connHandle;
+    uint8_t rsp[3];
+};
+
+static struct CpsCpResponse cpsCpResponses[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+static int numCpsCpResponses;
+static struct ble_npl_event cpsCpResponseEvent;
+
+static void cpsControlResponseSend(struct ble_npl_event *ev)
+{
+    for (int i = 0; i < numCpsCpResponses; i++) {
+        struct os_mbuf *om = ble_hs_mbuf_from_flat(cpsCpResponses[i].rsp, sizeof(cpsCpResponses[i].rsp));
+        if (om != NULL) {
+            ble_gatts_indicate_custom(cpsCpResponses[i].connHandle, cpsCpHandle, om);
+        }
+    }
+    numCpsCpResponses = 0;
+}
+
+static int cpsControlResponse(uint16_t connHandle, uint8_t opCode, uint8_t result)
+{
+    struct CpsCpResponse *response;
+
+    if (numCpsCpResponses == CONFIG_BT_NIMBLE_MAX_CONNECTIONS) {
+        return BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+
+    response = &cpsCpResponses[numCpsCpResponses++];
+    response->connHandle = connHandle;
+    response->rsp[0] = CPS_CP_RESPONSE_CODE;
+    response->rsp[1] = opCode;
+    response->rsp[2] = result;
+    ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &cpsCpResponseEvent);
+
+    return 0;
+}
+
+static int cpsControlWrite(uint16_t connHandle, const uint8_t *msg, uint16_t len)
+{
+    if (len < 1) {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+
+    if (!(clientGetSubs(connHandle) & SUB_CPS_CP)) {
+        return ATT_ERR_CCCD_IMPROPERLY_CONFIGURED;
+    }
+
+    // Masking the CPM content only changes the client's own
+    // view, so it is allowed without being in control, and it
+    // must not touch the shared simulation state.
+    if (msg[0] == CPS_CP_MASK_CPM_CONTENT) {
+        if (len < 3) {
+            return cpsControlResponse(connHandle, msg[0], CPS_CP_INVALID_PARAMETER);
+        }
+        clientSetCpmMask(connHandle, getUINT16(&msg[1]));
+        return cpsControlResponse(connHandle, msg[0], CPS_CP_SUCCESS);
+    }
+
+    // No other op code is supported, and replying so must not
+    // take control away from the other clients
+    return cpsControlResponse(connHandle, msg[0], CPS_CP_OP_CODE_NOT_SUPPORTED);
+}
+
 static int gatt_svr_chr_access_cycling_power(uint16_t connHandle, uint16_t attrHandle, struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
-    static uint8_t cycling_power_feature[4] = {0x09, 0x00, 0x00, 0x00}; // PEDAL_POWER_BALANCE, CRANK_REVOLUTION_DATA
-    static uint8_t sensor_location[1] = {0x0d};  // Rear Hub
+    static const uint8_t sensor_location[1] = {0x0d};  // Rear Hub
     char fmtBuf[BLE_UUID_STR_LEN];
     TickType_t ts = xTaskGetTickCount();
 
@@ -82,6 +152,8 @@ static int gatt_svr_chr_access_cycling_power(uint16_t connHandle, uint16_t attrH
         uint16_t uuid = ble_uuid_u16(ctxt->chr->uuid);
 
         if (uuid == GATT_CYCLING_POWER_FEATURE_UUID) {
+            uint8_t cycling_power_feature[4];
+            putUINT32(cycling_power_feature, personality->cpFeature);
             return (os_mbuf_append(ctxt->om, cycling_power_feature, sizeof(cycling_power_feature)) == 0) ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
         } else if (uuid == GATT_SENSOR_LOCATION_UUID) {
             return (os_mbuf_append(ctxt->om, sensor_location, sizeof(sensor_location)) == 0) ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
@@ -92,7 +164,7 @@ static int gatt_svr_chr_access_cycling_power(uint16_t connHandle, uint16_t attrH
                     printf("0x%02x ", ctxt->om->om_data[i]);
                 }
                 printf("}\n");
-                return 0;
+                return cpsControlWrite(connHandle, ctxt->om->om_data, ctxt->om->om_len);
             }
         }
     }
@@ -101,10 +173,38 @@ static int gatt_svr_chr_access_cycling_power(uint16_t connHandle, uint16_t attrH
     return BLE_ATT_ERR_UNLIKELY;
 }
 
+static int fecControlWrite(uint16_t connHandle, const uint8_t *msg, uint16_t len, int64_t ctrlTag)
+{
+    struct SimState sim;
+    int page;
+
+    // Only a valid FE-C message that changes the simulation can
+    // take control; anything else (e.g. a data page request) is
+    // accepted and ignored.
+    if ((page = fecParse(msg, len, &sim)) != FEC_PAGE_TARGET_POWER) {
+        return 0;
+    }
+
+    if (!clientRequestControl(connHandle)) {
+        return BLE_ATT_ERR_WRITE_NOT_PERMITTED;
+    }
+
+    // Only a CPM notification to the writer can measure its
+    // latency, so don't leave a tag nothing will consume
+    if (!(clientGetSubs(connHandle) & SUB_CPS_CPM)) {
+        ctrlTag = 0;
+    }
+
+    simSetTargetPower(connHandle, sim.targetPower, ctrlTag);
+
+    return 0;
+}
+
 static int gatt_svr_chr_access_tacx_fec_over_ble_service(uint16_t connHandle, uint16_t attrHandle, struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
 	char fmtBuf[BLE_UUID_STR_LEN];
 	TickType_t ts = xTaskGetTickCount();
+	int64_t ctrlTag = esp_timer_get_time();
 
     MODLOG_DFLT(INFO, "connHandle=%u attrHandle=%u op=%s uuid=%s len=%u",
     		connHandle, attrHandle, chrOp[ctxt->op], ble_uuid_to_str(ctxt->chr->uuid, fmtBuf), ctxt->om->om_len);
@@ -117,7 +217,7 @@ static int gatt_svr_chr_access_tacx_fec_over_ble_service(uint16_t connHandle, ui
                     printf("0x%02x ", ctxt->om->om_data[i]);
                 }
                 printf("}\n");
-                return 0;
+                return fecControlWrite(connHandle, ctxt->om->om_data, ctxt->om->om_len, ctrlTag);
             }
         }
     }
@@ -155,138 +255,313 @@ void gatt_svr_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg)
     }
 }
 
-static const struct ble_gatt_svc_def gatt_svr_svcs[] = {
+static const struct ble_gatt_chr_def device_info_chrs[] = {
         {
-            // Device Information Service
-            .type = BLE_GATT_SVC_TYPE_PRIMARY,
-            .uuid = BLE_UUID16_DECLARE(GATT_DEVICE_INFO_UUID),
-            .characteristics = (struct ble_gatt_chr_def[]) {
-                {
-                    /* Characteristic: Manufacturer name */
-                    .uuid = BLE_UUID16_DECLARE(GATT_MANUFACTURER_NAME_UUID),
-                    .access_cb = gatt_svr_chr_access_device_info,
-                    .flags = BLE_GATT_CHR_F_READ,
-                },
-                {
-                    /* Characteristic: Model number string */
-                    .uuid = BLE_UUID16_DECLARE(GATT_MODEL_NUMBER_UUID),
-                    .access_cb = gatt_svr_chr_access_device_info,
-                    .flags = BLE_GATT_CHR_F_READ,
-                },
-                {
-                    /* Characteristic: Serial number string */
-                    .uuid = BLE_UUID16_DECLARE(GATT_SERIAL_NUMBER_UUID),
-                    .access_cb = gatt_svr_chr_access_device_info,
-                    .flags = BLE_GATT_CHR_F_READ,
-                },
-                {
-                    /* Characteristic: Hardware Revision string */
-                    .uuid = BLE_UUID16_DECLARE(GATT_HARDWARE_REVISION_UUID),
-                    .access_cb = gatt_svr_chr_access_device_info,
-                    .flags = BLE_GATT_CHR_F_READ,
-                },
-                {
-                    /* Characteristic: Firmware Revision string */
-                    .uuid = BLE_UUID16_DECLARE(GATT_FIRMWARE_REVISION_UUID),
-                    .access_cb = gatt_svr_chr_access_device_info,
-                    .flags = BLE_GATT_CHR_F_READ,
-                },
-                {
-                    /* No more characteristics in this service */
-                    0,
-                },
-            }
+            /* Characteristic: Manufacturer name */
+            .uuid = CONST_UUID16(GATT_MANUFACTURER_NAME_UUID),
+            .access_cb = gatt_svr_chr_access_device_info,
+            .flags = BLE_GATT_CHR_F_READ,
+        },
+        {
+            /* Characteristic: Model number string */
+            .uuid = CONST_UUID16(GATT_MODEL_NUMBER_UUID),
+            .access_cb = gatt_svr_chr_access_device_info,
+            .flags = BLE_GATT_CHR_F_READ,
+        },
+        {
+            /* Characteristic: Serial number string */
+            .uuid = CONST_UUID16(GATT_SERIAL_NUMBER_UUID),
+            .access_cb = gatt_svr_chr_access_device_info,
+            .flags = BLE_GATT_CHR_F_READ,
         },
+        {
+            /* Characteristic: Hardware Revision string */
+            .uuid = CONST_UUID16(GATT_HARDWARE_REVISION_UUID),
+            .access_cb = gatt_svr_chr_access_device_info,
+            .flags = BLE_GATT_CHR_F_READ,
+        },
+        {
+            /* Characteristic: Firmware Revision string */
+            .uuid = CONST_UUID16(GATT_FIRMWARE_REVISION_UUID),
+            .access_cb = gatt_svr_chr_access_device_info,
+            .flags = BLE_GATT_CHR_F_READ,
+        },
+        {
+            /* No more characteristics in this service */
+            0,
+        },
+};
 
+static const struct ble_gatt_chr_def cycling_power_chrs[] = {
         {
-            // Cycling Power Service
-            .type = BLE_GATT_SVC_TYPE_PRIMARY,
-            .uuid = BLE_UUID16_DECLARE(GATT_CPS_UUID),
-            .characteristics = (struct ble_gatt_chr_def[]) {
-                {
-                    /* Characteristic: Cycling Power Measurement */
-                    .uuid = BLE_UUID16_DECLARE(GATT_CYCLING_POWER_MEASUREMENT_UUID),
-                    .access_cb = gatt_svr_chr_access_cycling_power,
-                    .val_handle = &cpsCpmHandle,
-                    .flags = BLE_GATT_CHR_F_NOTIFY,
-                },
-                {
-                    /* Characteristic: Cycling Power Feature */
-                    .uuid = BLE_UUID16_DECLARE(GATT_CYCLING_POWER_FEATURE_UUID),
-                    .access_cb = gatt_svr_chr_access_cycling_power,
-                    .flags = BLE_GATT_CHR_F_READ,
-                },
-                {
-                    /* Characteristic: Sensor Location */
-                    .uuid = BLE_UUID16_DECLARE(GATT_SENSOR_LOCATION_UUID),
-                    .access_cb = gatt_svr_chr_access_cycling_power,
-                    .flags = BLE_GATT_CHR_F_READ,
-                },
-                {
-                    /* Characteristic: Power Vector */
-                    .uuid = BLE_UUID16_DECLARE(GATT_CYCLING_POWER_VECTOR_UUID),
-                    .access_cb = gatt_svr_chr_access_cycling_power,
-                    .val_handle = &cpsPwrVecHandle,
-                    .flags = BLE_GATT_CHR_F_NOTIFY,
-                },
-                {
-                    /* Characteristic: Cycling Power Control Point */
-                    .uuid = BLE_UUID16_DECLARE(GATT_CYCLING_POWER_CONTROL_POINT_UUID),
-                    .access_cb = gatt_svr_chr_access_cycling_power,
-                    .flags = BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_INDICATE,
-                },
-                {
-                    /* No more characteristics in this service */
-                    0,
-                },
-            }
+            /* Characteristic: Cycling Power Measurement */
+            .uuid = CONST_UUID16(GATT_CYCLING_POWER_MEASUREMENT_UUID),
+            .access_cb = gatt_svr_chr_access_cycling_power,
+            .val_handle = &cpsCpmHandle,
+            .flags = BLE_GATT_CHR_F_NOTIFY,
         },
+        {
+            /* Characteristic: Cycling Power Feature */
+            .uuid = CONST_UUID16(GATT_CYCLING_POWER_FEATURE_UUID),
+            .access_cb = gatt_svr_chr_access_cycling_power,
+            .flags = BLE_GATT_CHR_F_READ,
+        },
+        {
+            /* Characteristic: Sensor Location */
+            .uuid = CONST_UUID16(GATT_SENSOR_LOCATION_UUID),
+            .access_cb = gatt_svr_chr_access_cycling_power,
+            .flags = BLE_GATT_CHR_F_READ,
+        },
+        {
+            /* Characteristic: Power Vector */
+            .uuid = CONST_UUID16(GATT_CYCLING_POWER_VECTOR_UUID),
+            .access_cb = gatt_svr_chr_access_cycling_power,
+            .val_handle = &cpsPwrVecHandle,
+            .flags = BLE_GATT_CHR_F_NOTIFY,
+        },
+        {
+            /* Characteristic: Cycling Power Control Point */
+            .uuid = CONST_UUID16(GATT_CYCLING_POWER_CONTROL_POINT_UUID),
+            .access_cb = gatt_svr_chr_access_cycling_power,
+            .val_handle = &cpsCpHandle,
+            .flags = BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_INDICATE,
+        },
+        {
+            /* No more characteristics in this service */
+            0,
+        },
+};
 
+static const struct ble_gatt_chr_def tacx_fec_chrs[] = {
         {
-            // TACX FE-C Over BLE Service: 6e40fec1-b5a3-f393-e0a9-e50e24dcca9e
-            .type = BLE_GATT_SVC_TYPE_PRIMARY,
-            .uuid = BLE_UUID128_DECLARE(0x96, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, 0xc1, 0xfe, 0x40, 0x6e),
-            .characteristics = (struct ble_gatt_chr_def[]) {
-                {
-                    /* Characteristic: ??? 6e40fec2-b5a3-f393-e0a9-e50e24dcca9e */
-                    .uuid = BLE_UUID128_DECLARE(0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, 0xc2, 0xfe, 0x40, 0x6e),
-                    .access_cb = gatt_svr_chr_access_tacx_fec_over_ble_service,
-                    .val_handle = &fec2ChrHandle,
-                    .flags = BLE_GATT_CHR_F_NOTIFY,
-                },
-                {
-                    /* Characteristic: ??? 6e40fec3-b5a3-f393-e0a9-e50e24dcca9e */
-                    .uuid = BLE_UUID128_DECLARE(0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, 0xc3, 0xfe, 0x40, 0x6e),
-                    .access_cb = gatt_svr_chr_access_tacx_fec_over_ble_service,
-                    .val_handle = &fec3ChrHandle,
-                    .flags = BLE_GATT_CHR_F_WRITE,
-                },
-                {
-                    /* No more characteristics in this service */
-                    0,
-                },
-            }
+            /* Characteristic: ??? 6e40fec2-b5a3-f393-e0a9-e50e24dcca9e */
+            .uuid = CONST_UUID128(0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, 0xc2, 0xfe, 0x40, 0x6e),
+            .access_cb = gatt_svr_chr_access_tacx_fec_over_ble_service,
+            .val_handle = &fec2ChrHandle,
+            .flags = BLE_GATT_CHR_F_NOTIFY,
+        },
+        {
+            /* Characteristic: ??? 6e40fec3-b5a3-f393-e0a9-e50e24dcca9e */
+            .uuid = CONST_UUID128(0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, 0xc3, 0xfe, 0x40, 0x6e),
+            .access_cb = gatt_svr_chr_access_tacx_fec_over_ble_service,
+            .val_handle = &fec3ChrHandle,
+            .flags = BLE_GATT_CHR_F_WRITE,
+        },
+        {
+            /* No more characteristics in this service */
+            0,
         },
+};
+
+// Service definitions used by personality.def
 
+#define SVC_DEVICE_INFO {                                       \
+            .type = BLE_GATT_SVC_TYPE_PRIMARY,                  \
+            .uuid = CONST_UUID16(GATT_DEVICE_INFO_UUID),        \
+            .characteristics = device_info_chrs,                \
+        }
+
+#define SVC_CYCLING_POWER {                                     \
+            .type = BLE_GATT_SVC_TYPE_PRIMARY,                  \
+            .uuid = CONST_UUID16(GATT_CPS_UUID),                \
+            .characteristics = cycling_power_chrs,              \
+        }
 
-    {
-        /* No more services */
-        0,
+// TACX FE-C Over BLE Service: 6e40fec1-b5a3-f393-e0a9-e50e24dcca9e
+#define SVC_TACX_FEC {                                          \
+            .type = BLE_GATT_SVC_TYPE_PRIMARY,                  \
+            .uuid = CONST_UUID128(0x96, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, 0xc1, 0xfe, 0x40, 0x6e), \
+            .characteristics = tacx_fec_chrs,                   \
+        }
+
+#define SVC_LIST(...) __VA_ARGS__
+
+// One const service table per personality
+#define PERSONALITY(id, deviceName, manufName, modelNum, serialNum, hardRev, firmRev, cpFeature, services) \
+    _Static_assert(sizeof (deviceName) - 1 <= ADV_MAX_NAME_LEN, #id ": device name too long to advertise"); \
+    static const struct ble_gatt_svc_def id##_svcs[] = { SVC_LIST services, { 0 } };
+#include "personality.def"
+#undef PERSONALITY
+
+const struct Personality personalities[] = {
+#define PERSONALITY(id, deviceName_, manufName_, modelNum_, serialNum_, hardRev_, firmRev_, cpFeature_, services) \
+    {                                   \
+        .name = #id,                    \
+        .deviceName = deviceName_,      \
+        .manufName = manufName_,        \
+        .modelNum = modelNum_,          \
+        .serialNum = serialNum_,        \
+        .hardRev = hardRev_,            \
+        .firmRev = firmRev_,            \
+        .cpFeature = cpFeature_,        \
+        .svcs = id##_svcs,              \
+        .numSvcs = sizeof ((const struct ble_gatt_svc_def[]) { SVC_LIST services }) / sizeof (struct ble_gatt_svc_def), \
     },
+#include "personality.def"
+#undef PERSONALITY
+};
+
+const int numPersonalities = sizeof (personalities) / sizeof (personalities[0]);
+
+// What the GATT specifications (and notifyTask) require from
+// each service a personality can include: the characteristics
+// it must have, and the properties each of them must support.
+
+struct ChrSpec {
+    const ble_uuid_t *uuid;
+    uint16_t flags;
+};
+
+struct SvcSpec {
+    const char *name;
+    const ble_uuid_t *uuid;
+    bool required;
+    const struct ChrSpec *chrs;
+};
+
+static const struct ChrSpec device_info_spec[] = {
+        { CONST_UUID16(GATT_MANUFACTURER_NAME_UUID), BLE_GATT_CHR_F_READ },
+        { CONST_UUID16(GATT_MODEL_NUMBER_UUID), BLE_GATT_CHR_F_READ },
+        { CONST_UUID16(GATT_SERIAL_NUMBER_UUID), BLE_GATT_CHR_F_READ },
+        { CONST_UUID16(GATT_HARDWARE_REVISION_UUID), BLE_GATT_CHR_F_READ },
+        { CONST_UUID16(GATT_FIRMWARE_REVISION_UUID), BLE_GATT_CHR_F_READ },
+        { NULL, 0 },
+};
+
+static const struct ChrSpec cycling_power_spec[] = {
+        { CONST_UUID16(GATT_CYCLING_POWER_MEASUREMENT_UUID), BLE_GATT_CHR_F_NOTIFY },
+        { CONST_UUID16(GATT_CYCLING_POWER_FEATURE_UUID), BLE_GATT_CHR_F_READ },
+        { CONST_UUID16(GATT_SENSOR_LOCATION_UUID), BLE_GATT_CHR_F_READ },
+        { CONST_UUID16(GATT_CYCLING_POWER_CONTROL_POINT_UUID), BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_INDICATE },
+        { NULL, 0 },
 };
 
-int gatt_svr_init(void)
+static const struct ChrSpec tacx_fec_spec[] = {
+        { CONST_UUID128(0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, 0xc2, 0xfe, 0x40, 0x6e), BLE_GATT_CHR_F_NOTIFY },
+        { CONST_UUID128(0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, 0xc3, 0xfe, 0x40, 0x6e), BLE_GATT_CHR_F_WRITE },
+        { NULL, 0 },
+};
+
+static const struct SvcSpec svc_spec[] = {
+        { "DIS", CONST_UUID16(GATT_DEVICE_INFO_UUID), true, device_info_spec },
+        { "CPS", CONST_UUID16(GATT_CPS_UUID), true, cycling_power_spec },
+        { "FEC", CONST_UUID128(0x96, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, 0xc1, 0xfe, 0x40, 0x6e), false, tacx_fec_spec },
+};
+
+// Cycling Power Feature bits the firmware actually implements
+#define CPF_SUPPORTED   (CPF_PEDAL_POWER_BALANCE | CPF_CRANK_REVOLUTION_DATA | CPF_CONTENT_MASKING)
+
+static const struct ble_gatt_svc_def *svcFind(const struct ble_gatt_svc_def *svcs, const ble_uuid_t *uuid)
+{
+    for (; svcs->type != 0; svcs++) {
+        if (ble_uuid_cmp(svcs->uuid, uuid) == 0) {
+            return svcs;
+        }
+    }
+
+    return NULL;
+}
+
+static const struct ble_gatt_chr_def *chrFind(const struct ble_gatt_chr_def *chrs, const ble_uuid_t *uuid)
+{
+    for (; chrs->uuid != NULL; chrs++) {
+        if (ble_uuid_cmp(chrs->uuid, uuid) == 0) {
+            return chrs;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Check a personality's generated service table against its
+ * entry in personality.def and against svc_spec. Returns 0 if
+ * it is valid, or BLE_HS_EINVAL after logging the first
+ * problem found.
+ */
+int personalityCheck(const struct Personality *p)
+{
+    int numSvcs = 0;
+
+    if (p->cpFeature & ~CPF_SUPPORTED) {
+        MODLOG_DFLT(ERROR, "%s: unsupported cpFeature bits 0x%08" PRIx32 "\n", p->name, p->cpFeature & ~CPF_SUPPORTED);
+        return BLE_HS_EINVAL;
+    }
+
+    for (const struct ble_gatt_svc_def *svc = p->svcs; svc->type != 0; svc++) {
+        if (svcFind(svc + 1, svc->uuid) != NULL) {
+            MODLOG_DFLT(ERROR, "%s: duplicate service %d\n", p->name, numSvcs);
+            return BLE_HS_EINVAL;
+        }
+        if ((svc->characteristics == NULL) || (svc->characteristics[0].uuid == NULL)) {
+            MODLOG_DFLT(ERROR, "%s: service %d has no characteristics\n", p->name, numSvcs);
+            return BLE_HS_EINVAL;
+        }
+        for (const struct ble_gatt_chr_def *chr = svc->characteristics; chr->uuid != NULL; chr++) {
+            if (chr->access_cb == NULL) {
+                MODLOG_DFLT(ERROR, "%s: service %d has a characteristic without access_cb\n", p->name, numSvcs);
+                return BLE_HS_EINVAL;
+            }
+        }
+        numSvcs++;
+    }
+
+    if (numSvcs != p->numSvcs) {
+        MODLOG_DFLT(ERROR, "%s: %d services in table, %d in personality.def\n", p->name, numSvcs, p->numSvcs);
+        return BLE_HS_EINVAL;
+    }
+
+    for (int i = 0; i < (int) (sizeof (svc_spec) / sizeof (svc_spec[0])); i++) {
+        const struct SvcSpec *spec = &svc_spec[i];
+        const struct ble_gatt_svc_def *svc = svcFind(p->svcs, spec->uuid);
+
+        if (svc == NULL) {
+            if (spec->required) {
+                MODLOG_DFLT(ERROR, "%s: missing %s service\n", p->name, spec->name);
+                return BLE_HS_EINVAL;
+            }
+            continue;
+        }
+
+        for (const struct ChrSpec *chrSpec = spec->chrs; chrSpec->uuid != NULL; chrSpec++) {
+            const struct ble_gatt_chr_def *chr = chrFind(svc->characteristics, chrSpec->uuid);
+
+            if ((chr == NULL) || ((chr->flags & chrSpec->flags) != chrSpec->flags)) {
+                MODLOG_DFLT(ERROR, "%s: %s characteristic %d missing or lacks flags 0x%04x\n",
+                        p->name, spec->name, (int) (chrSpec - spec->chrs), chrSpec->flags);
+                return BLE_HS_EINVAL;
+            }
+            if ((chrSpec->flags & (BLE_GATT_CHR_F_NOTIFY | BLE_GATT_CHR_F_INDICATE)) && (chr->val_handle == NULL)) {
+                MODLOG_DFLT(ERROR, "%s: %s characteristic %d has no val_handle\n",
+                        p->name, spec->name, (int) (chrSpec - spec->chrs));
+                return BLE_HS_EINVAL;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int gatt_svr_init(const struct Personality *p)
 {
     int rc;
 
+    if ((rc = personalityCheck(p)) != 0) {
+        return rc;
+    }
+
+    personality = p;
+
+    ble_npl_event_init(&cpsCpResponseEvent, cpsControlResponseSend, NULL);
+
     ble_svc_gap_init();
     ble_svc_gatt_init();
 
-    if ((rc = ble_gatts_count_cfg(gatt_svr_svcs)) != 0) {
+    if ((rc = ble_gatts_count_cfg(personality->svcs)) != 0) {
         return rc;
     }
 
-    if ((rc = ble_gatts_add_svcs(gatt_svr_svcs)) != 0) {
+    if ((rc = ble_gatts_add_svcs(personality->svcs)) != 0) {
         return rc;
     }
 
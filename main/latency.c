@@ -0,0 +1,191 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "host/ble_hs.h"
+#include "ble.h"
+#include "sdkconfig.h"
+
+// Control-to-effect latency histograms, one per connection.
+// Bucket N counts the latencies in the range [2^N, 2^(N+1))
+// usec; the last bucket also counts anything larger.
+//
+// "queued" is measured right before the notification is handed
+// to NimBLE, "hostTx" when NimBLE reports BLE_GAP_EVENT_NOTIFY_TX.
+// For notifications that event is raised synchronously once the
+// PDU has been passed down to the controller, so it does NOT
+// include the time spent waiting for the next connection event
+// or for the over-the-air transmission.
+struct LatencyHist {
+    uint32_t bucket[LATENCY_NUM_BUCKETS];
+    uint32_t count;
+    int64_t max;        // usec
+};
+
+struct ConnLatency {
+    uint16_t connHandle;
+    int64_t txTag;      // control tag of the notification pending host TX
+    struct LatencyHist queued;
+    struct LatencyHist hostTx;
+};
+
+static struct ConnLatency connLatency[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+static portMUX_TYPE latencyLock = portMUX_INITIALIZER_UNLOCKED;
+
+static struct ConnLatency *latencyFind(uint16_t connHandle)
+{
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+        if (connLatency[i].connHandle == connHandle) {
+            return &connLatency[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void latencyHistAdd(struct LatencyHist *hist, int64_t latency)
+{
+    int n = 0;
+
+    if (latency > 1) {
+        n = 63 - __builtin_clzll((uint64_t) latency);
+        if (n >= LATENCY_NUM_BUCKETS) {
+            n = LATENCY_NUM_BUCKETS - 1;
+        }
+    }
+
+    hist->bucket[n]++;
+    hist->count++;
+    if (latency > hist->max) {
+        hist->max = latency;
+    }
+}
+
+static void latencyHistPrint(const char *name, const struct LatencyHist *hist)
+{
+    printf("  %s: count=%" PRIu32 " max=%" PRId64 "us {", name, hist->count, hist->max);
+    for (int n = 0; n < LATENCY_NUM_BUCKETS; n++) {
+        if (hist->bucket[n] == 0) {
+            continue;
+        }
+        if (n == (LATENCY_NUM_BUCKETS - 1)) {
+            printf(" >=%luus:%" PRIu32, (1UL << n), hist->bucket[n]);
+        } else {
+            printf(" <%luus:%" PRIu32, (1UL << (n + 1)), hist->bucket[n]);
+        }
+    }
+    printf(" }\n");
+}
+
+void latencyConnOpen(uint16_t connHandle)
+{
+    taskENTER_CRITICAL(&latencyLock);
+    struct ConnLatency *conn = latencyFind(BLE_HS_CONN_HANDLE_NONE);
+    if (conn != NULL) {
+        memset(conn, 0, sizeof(*conn));
+        conn->connHandle = connHandle;
+    }
+    taskEXIT_CRITICAL(&latencyLock);
+}
+
+void latencyConnClose(uint16_t connHandle)
+{
+    taskENTER_CRITICAL(&latencyLock);
+    struct ConnLatency *conn = latencyFind(connHandle);
+    if (conn != NULL) {
+        conn->connHandle = BLE_HS_CONN_HANDLE_NONE;
+    }
+    taskEXIT_CRITICAL(&latencyLock);
+}
+
+void latencyQueued(uint16_t connHandle, int64_t ctrlTag)
+{
+    int64_t now = esp_timer_get_time();
+
+    taskENTER_CRITICAL(&latencyLock);
+    struct ConnLatency *conn = latencyFind(connHandle);
+    if (conn != NULL) {
+        latencyHistAdd(&conn->queued, now - ctrlTag);
+        conn->txTag = ctrlTag;
+    }
+    taskEXIT_CRITICAL(&latencyLock);
+}
+
+void latencyHostTx(uint16_t connHandle)
+{
+    int64_t now = esp_timer_get_time();
+
+    taskENTER_CRITICAL(&latencyLock);
+    struct ConnLatency *conn = latencyFind(connHandle);
+    if ((conn != NULL) && (conn->txTag != 0)) {
+        latencyHistAdd(&conn->hostTx, now - conn->txTag);
+        conn->txTag = 0;
+    }
+    taskEXIT_CRITICAL(&latencyLock);
+}
+
+void latencyPrint(uint16_t connHandle)
+{
+    struct ConnLatency conn;
+    bool found = false;
+
+    // Print from a snapshot, so the lock is not held during I/O
+    taskENTER_CRITICAL(&latencyLock);
+    struct ConnLatency *p = latencyFind(connHandle);
+    if (p != NULL) {
+        conn = *p;
+        found = true;
+    }
+    taskEXIT_CRITICAL(&latencyLock);
+
+    if (found) {
+        printf("latency: connHandle=%u\n", connHandle);
+        latencyHistPrint("queued", &conn.queued);
+        latencyHistPrint("hostTx", &conn.hostTx);
+    }
+}
+
+// Get the number of samples in a connection's histograms.
+// Returns false if the connection is unknown.
+bool latencyCounts(uint16_t connHandle, uint32_t *queued, uint32_t *hostTx)
+{
+    bool found = false;
+
+    taskENTER_CRITICAL(&latencyLock);
+    struct ConnLatency *conn = latencyFind(connHandle);
+    if (conn != NULL) {
+        *queued = conn->queued.count;
+        *hostTx = conn->hostTx.count;
+        found = true;
+    }
+    taskEXIT_CRITICAL(&latencyLock);
+
+    return found;
+}
+
+void latencyInit(void)
+{
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+        connLatency[i].connHandle = BLE_HS_CONN_HANDLE_NONE;
+    }
+}
@@ -18,6 +18,9 @@
  */
 
 #include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_timer.h"
+#include "nvs.h"
 #include "nvs_flash.h"
 #include "freertos/FreeRTOSConfig.h"
 /* BLE */
@@ -36,13 +39,25 @@ static const char *tag = "NimBLE";
 
 static TaskHandle_t notifyTaskHandle;
 
-static bool cpsCpmNotify = false;
-static bool cpsPwrVecNotify = false;
-static bool fec2Notify = false;
+// Subscriptions notifyTask actually sends notifications for;
+// any other subscription must not make it wake up.
+#define NOTIFY_TASK_SUBS        (SUB_CPS_CPM)
 
-static uint16_t connHandle;
+// Owned by notifyTask
+struct NotifyStats {
+    uint32_t wakeups;       // number of times notifyTask ran
+    uint64_t activeTime;    // time spent running, in usec
+};
 
-static const char *device_name = "TACX FLUX2 NNNN";
+static struct NotifyStats notifyStats;
+
+// Shared by the GATT access callbacks and notifyTask
+static struct SimState simState = {
+    .targetPower = 225,
+};
+static portMUX_TYPE simLock = portMUX_INITIALIZER_UNLOCKED;
+
+static const struct Personality *personality;
 
 static int bleGapEvent(struct ble_gap_event *event, void *arg);
 
@@ -57,90 +72,6 @@ void print_addr(const void *addr)
                 u8p[5], u8p[4], u8p[3], u8p[2], u8p[1], u8p[0]);
 }
 
-// GET signed values
-
-int8_t getSINT8(const uint8_t *data)
-{
-    uint8_t value = data[0];
-    return (int8_t) value;
-}
-
-int16_t getSINT16(const uint8_t *data)
-{
-    uint16_t value = ((uint16_t) data[1] << 8) | (uint16_t) data[0];
-    return (int16_t) value;
-}
-
-int32_t getSINT24(const uint8_t *data)
-{
-    uint32_t value = ((uint32_t) data[2] <<16) | ((uint32_t) data[1] << 8) | (uint32_t) data[0];
-    return (int32_t) value;
-}
-
-int32_t getSINT32(const uint8_t *data)
-{
-    uint32_t value = ((uint32_t) data[3] << 24) | ((uint32_t) data[2] <<16) | ((uint32_t) data[1] << 8) | (uint32_t) data[0];
-    return (int32_t) value;
-}
-
-// GET unsigned values
-
-uint8_t getUINT8(const uint8_t *data)
-{
-    uint8_t value = data[0];
-    return value;
-}
-
-uint16_t getUINT16(const uint8_t *data)
-{
-    uint16_t value = ((uint16_t) data[1] << 8) | (uint16_t) data[0];
-    return value;
-}
-
-uint32_t getUINT24(const uint8_t *data)
-{
-    uint32_t value = ((uint32_t) data[2] <<16) | ((uint32_t) data[1] << 8) | (uint32_t) data[0];
-    return value;
-}
-
-uint32_t getUINT32(const uint8_t *data)
-{
-    uint32_t value = ((uint32_t) data[3] << 24) | ((uint32_t) data[2] << 16) | ((uint32_t) data[1] << 8) | (uint32_t) data[0];
-    return value;
-}
-
-// PUT signed values
-
-void putSINT16(uint8_t *data, int16_t value)
-{
-    *data++ = (value & 0xff);
-    *data = ((value >> 8) & 0xff);
-}
-
-// PUT unsigned values
-
-void putUINT16(uint8_t *data, uint16_t value)
-{
-    *data++ = (value & 0xff);
-    *data = ((value >> 8) & 0xff);
-}
-
-void putUINT24(uint8_t *data, uint32_t value)
-{
-    *data++ = (value & 0xff);
-    *data++ = ((value >> 8) & 0xff);
-    *data = ((value >> 16) & 0xff);
-}
-
-void putUINT32(uint8_t *data, uint32_t value)
-{
-    *data++ = (value & 0xff);
-    *data++ = ((value >> 8) & 0xff);
-    *data++ = ((value >> 16) & 0xff);
-    *data = ((value >> 24) & 0xff);
-}
-
-
 /*
  * Enables advertising with parameters:
  *     o General discoverable mode
@@ -152,6 +83,16 @@ static void bleAdvertise(void)
     struct ble_hs_adv_fields fields;
     int rc;
 
+    /* Advertising may still be running to accept more clients */
+    if (ble_gap_adv_active()) {
+        return;
+    }
+
+    /* NimBLE refuses to advertise once all connections are in use */
+    if (clientFull()) {
+        return;
+    }
+
     /*
      *  Set the advertisement data included in our advertisements:
      *     o Flags (indicates advertisement type and other general info)
@@ -176,8 +117,8 @@ static void bleAdvertise(void)
     fields.tx_pwr_lvl_is_present = 1;
     fields.tx_pwr_lvl = BLE_HS_ADV_TX_PWR_LVL_AUTO;
 
-    fields.name = (uint8_t *)device_name;
-    fields.name_len = strlen(device_name);
+    fields.name = (uint8_t *)personality->deviceName;
+    fields.name_len = strlen(personality->deviceName);
     fields.name_is_complete = 1;
     
     fields.uuids16 = (ble_uuid16_t[]) {
@@ -203,51 +144,150 @@ static void bleAdvertise(void)
     }
 }
 
+void simSetTargetPower(uint16_t connHandle, int16_t targetPower, int64_t ctrlTag)
+{
+    taskENTER_CRITICAL(&simLock);
+    simState.targetPower = targetPower;
+    simState.ctrlConn = connHandle;
+    simState.ctrlTag = ctrlTag;
+    taskEXIT_CRITICAL(&simLock);
+}
+
+// Get a copy of the simulation state, and consume its control
+// tag: only the first notification reflecting a control write
+// counts towards its latency.
+void simSnapshot(struct SimState *state)
+{
+    taskENTER_CRITICAL(&simLock);
+    *state = simState;
+    simState.ctrlTag = 0;
+    taskEXIT_CRITICAL(&simLock);
+}
+
+static void notifyStatsPrint(TickType_t ts)
+{
+    printf("ts: %" PRIu32 " notifyStats: { wakeups=%" PRIu32 " activeTime=%" PRIu64 "us }\n",
+            ts, notifyStats.wakeups, notifyStats.activeTime);
+}
+
 static void notifyTask(void *parms)
 {
     struct os_mbuf *om = NULL;
     const TickType_t notifyPeriod = pdMS_TO_TICKS(1000);  // 1 second
+    const uint32_t statsPeriod = 60;    // notifications
+    TickType_t nextWake = 0;
+    uint32_t subs = 0;
 
     while (true) {
-        TickType_t start, end;
-
-        start = xTaskGetTickCount();
-
-        if (cpsCpmNotify) {
-            const uint16_t flags = CPM_INSTANT_POWER | CPM_PEDAL_POWER_BALANCE | CPM_CRANK_REVOLUTION_DATA;
-            const int16_t instantPower = 225;
-            const uint8_t pedalPowerBalance = 100;  // 50%
-            static uint16_t cumulativeCrankRevolutions;
-            static uint16_t lastCrankEventTime;
-            struct CpmData cpmData;
+        TickType_t timeout = portMAX_DELAY;
+        TickType_t ts;
+        uint32_t value;
+        int64_t start;
+
+        if (subs != 0) {
+            TickType_t now = xTaskGetTickCount();
+            int32_t delta = (int32_t) (nextWake - now);
+            timeout = (delta > 0) ? (TickType_t) delta : 0;
+        }
 
-            // 2 revolutions in 1 sec (1024 ticks) = 120 RPM
-            cumulativeCrankRevolutions += 2;
-            lastCrankEventTime += 1024;
+        // Block until the next deadline, or forever if nobody is
+        // subscribed to anything this task sends, unless the
+        // subscriptions change first.
+        if (xTaskNotifyWait(0, 0, &value, timeout) == pdTRUE) {
+            start = esp_timer_get_time();
+            notifyStats.wakeups++;
+
+            value &= NOTIFY_TASK_SUBS;
+            if ((subs == 0) && (value != 0)) {
+                // First subscriber: send the first notification now
+                nextWake = xTaskGetTickCount();
+            } else if ((subs != 0) && (value == 0)) {
+                // Last subscriber gone: no notification will reflect
+                // a pending control write in time, so consume its tag
+                struct SimState sim;
+
+                simSnapshot(&sim);
+            }
+            subs = value;
 
-            putUINT16(cpmData.flags, flags);
-            putSINT16(cpmData.instPower, instantPower);
-            cpmData.pedalPowerBalance = pedalPowerBalance;
-            putUINT16(cpmData.cumulativeCrankRevolutions, cumulativeCrankRevolutions);
-            putUINT16(cpmData.lastCrankEventTime, lastCrankEventTime);
+            notifyStats.activeTime += esp_timer_get_time() - start;
+            notifyStatsPrint(xTaskGetTickCount());
+            continue;
+        }
 
-            om = ble_hs_mbuf_from_flat(&cpmData, sizeof(cpmData));
+        start = esp_timer_get_time();
+        notifyStats.wakeups++;
+        ts = xTaskGetTickCount();
 
-            printf("ts: %" PRIu32 " cpsCpmNotify: { ", start);
-            for (int i = 0; i < om->om_len; i++) {
-                printf("0x%02x ", om->om_data[i]);
+        if (subs & SUB_CPS_CPM) {
+            static struct CpmState cpmState;
+            static struct CpmView cpmViews[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+            static uint32_t cpmViewGen[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+            static uint32_t numNotifications;
+            struct Client clients[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+            struct CpmData cpmData;
+            struct SimState sim;
+
+            simSnapshot(&sim);
+            cpmEncode(&cpmData, &cpmState, &sim);
+            clientSnapshot(clients);
+
+            // One shared measurement, sent through each client's view
+            for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+                const struct Client *client = &clients[i];
+                struct CpmView *view = &cpmViews[i];
+                uint8_t buf[sizeof (struct CpmData)];
+                int len;
+
+                if ((client->connHandle == BLE_HS_CONN_HANDLE_NONE) || !(client->subs & SUB_CPS_CPM)) {
+                    continue;
+                }
+
+                if (cpmViewGen[i] != client->gen) {
+                    cpmViewGen[i] = client->gen;
+                    view->crankRevOffset = cpmState.cumulativeCrankRevolutions;
+                    view->crankTimeOffset = cpmState.lastCrankEventTime;
+                }
+                view->mask = client->cpmMask | cpmFeatureMask(personality->cpFeature);
+
+                len = cpmView(buf, &cpmData, view);
+                om = ble_hs_mbuf_from_flat(buf, len);
+
+                printf("ts: %" PRIu32 " cpsCpmNotify: connHandle=%u { ", ts, client->connHandle);
+                for (int j = 0; j < om->om_len; j++) {
+                    printf("0x%02x ", om->om_data[j]);
+                }
+                printf("}\n");
+
+                if ((sim.ctrlTag != 0) && (sim.ctrlConn == client->connHandle)) {
+                    latencyQueued(client->connHandle, sim.ctrlTag);
+                }
+                ble_gatts_notify_custom(client->connHandle, cpsCpmHandle, om);
             }
-            printf("}\n");
 
-            ble_gatts_notify_custom(connHandle, cpsCpmHandle, om);
+            if ((++numNotifications % statsPeriod) == 0) {
+                notifyStatsPrint(ts);
+                for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+                    if (clients[i].connHandle != BLE_HS_CONN_HANDLE_NONE) {
+                        latencyPrint(clients[i].connHandle);
+                    }
+                }
+            }
         }
 
-        end = xTaskGetTickCount();
+        nextWake += notifyPeriod;
 
-        vTaskDelay(notifyPeriod - (end - start));
+        notifyStats.activeTime += esp_timer_get_time() - start;
     }
 }
 
+// The task notification value sent to notifyTask carries the
+// subscriptions of all the clients, OR'ed together.
+static void notifySubscriptions(uint32_t subs)
+{
+    xTaskNotify(notifyTaskHandle, subs, eSetValueWithOverwrite);
+}
+
 static int bleGapEvent(struct ble_gap_event *event, void *arg)
 {
     switch (event->type) {
@@ -260,13 +300,24 @@ static int bleGapEvent(struct ble_gap_event *event, void *arg)
         if (event->connect.status != 0) {
             /* Connection failed; resume advertising */
             bleAdvertise();
+        } else {
+            clientOpen(event->connect.conn_handle);
+            latencyConnOpen(event->connect.conn_handle);
+
+            /* Keep advertising, to let more clients connect */
+            bleAdvertise();
         }
-        connHandle = event->connect.conn_handle;
         break;
 
     case BLE_GAP_EVENT_DISCONNECT:
         MODLOG_DFLT(INFO, "disconnect; reason=%d\n", event->disconnect.reason);
 
+        latencyPrint(event->disconnect.conn.conn_handle);
+        latencyConnClose(event->disconnect.conn.conn_handle);
+
+        /* Put notifyTask back to sleep if this was the last subscriber */
+        notifySubscriptions(clientClose(event->disconnect.conn.conn_handle));
+
         /* Connection terminated; resume advertising */
         bleAdvertise();
         break;
@@ -278,13 +329,26 @@ static int bleGapEvent(struct ble_gap_event *event, void *arg)
 
     case BLE_GAP_EVENT_SUBSCRIBE:
         MODLOG_DFLT(INFO, "SUBSCRIBE: cur_notify=%u attr_handle=%u", event->subscribe.cur_notify, event->subscribe.attr_handle);
-        bool enabled = !! event->subscribe.cur_notify;
+        uint32_t sub = 0;
         if (event->subscribe.attr_handle == cpsCpmHandle) {
-            cpsCpmNotify = enabled;
+            sub = SUB_CPS_CPM;
         } else if (event->subscribe.attr_handle == cpsPwrVecHandle) {
-            cpsPwrVecNotify = enabled;
+            sub = SUB_CPS_PWR_VEC;
         } else if (event->subscribe.attr_handle == fec2ChrHandle) {
-            fec2Notify = enabled;
+            sub = SUB_FEC2;
+        } else if (event->subscribe.attr_handle == cpsCpHandle) {
+            sub = SUB_CPS_CP;
+        }
+        if (sub != 0) {
+            bool enabled = event->subscribe.cur_notify || event->subscribe.cur_indicate;
+            notifySubscriptions(clientSubscribe(event->subscribe.conn_handle, sub, enabled));
+        }
+        break;
+
+    case BLE_GAP_EVENT_NOTIFY_TX:
+        if ((event->notify_tx.attr_handle == cpsCpmHandle) && !event->notify_tx.indication &&
+            (event->notify_tx.status == 0)) {
+            latencyHostTx(event->notify_tx.conn_handle);
         }
         break;
 
@@ -326,6 +390,30 @@ static void bleOnReset(int reason)
     MODLOG_DFLT(ERROR, "Resetting state; reason=%d\n", reason);
 }
 
+/*
+ * Get the trainer personality to emulate, as selected by the
+ * "personality" key in the "simTACX" NVS namespace. Defaults
+ * to the first one if the key is missing or invalid. The key
+ * is set with the "personality" console command.
+ */
+static const struct Personality *personalityLoad(void)
+{
+    nvs_handle_t nvsHandle;
+    uint8_t index = 0;
+    esp_err_t ret;
+
+    if ((ret = nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvsHandle)) == ESP_OK) {
+        ret = nvs_get_u8(nvsHandle, NVS_KEY_PERSONALITY, &index);
+        nvs_close(nvsHandle);
+    }
+
+    if ((ret != ESP_OK) || (index >= numPersonalities)) {
+        index = 0;
+    }
+
+    return &personalities[index];
+}
+
 static void bleHostTask(void *param)
 {
     ESP_LOGI(tag, "BLE Host Task Started");
@@ -348,6 +436,16 @@ void app_main(void)
     }
     ESP_ERROR_CHECK(ret);
 
+#if CONFIG_PM_ENABLE
+    /* Enter light sleep automatically between connection events */
+    esp_pm_config_t pmConfig = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = CONFIG_XTAL_FREQ,
+        .light_sleep_enable = true,
+    };
+    ESP_ERROR_CHECK(esp_pm_configure(&pmConfig));
+#endif
+
     ret = nimble_port_init();
     if (ret != ESP_OK) {
         MODLOG_DFLT(ERROR, "Failed to init nimble %d \n", ret);
@@ -358,15 +456,24 @@ void app_main(void)
     ble_hs_cfg.sync_cb = bleOnSync;
     ble_hs_cfg.reset_cb = bleOnReset;
 
+    clientInit();
+    latencyInit();
+
     xTaskCreate(notifyTask, "notifyTask", NOTIFY_TASK_STACK_SIZE, NULL, NOTIFY_TASK_PRIORITY, &notifyTaskHandle);
 
-    rc = gatt_svr_init();
+    personality = personalityLoad();
+    MODLOG_DFLT(INFO, "personality=%s", personality->name);
+
+    rc = gatt_svr_init(personality);
     assert(rc == 0);
 
     /* Set the default device name */
-    rc = ble_svc_gap_device_name_set(device_name);
+    rc = ble_svc_gap_device_name_set(personality->deviceName);
     assert(rc == 0);
 
     /* Start the task */
     nimble_port_freertos_init(bleHostTask);
+
+    /* Start the console, to switch personalities without reflashing */
+    cmdInit(personality);
 }
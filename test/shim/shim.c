@@ -0,0 +1,785 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+// The firmware's tasks run under a virtual clock: the calling
+// (harness) thread plays the NimBLE host task, and the one task
+// created with xTaskCreate() runs on its own thread. The two
+// hand over to each other, so only one of them runs at a time
+// and virtual time only moves when the harness says so.
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "shim.h"
+
+#define SHIM_MAX_ATTRS                  64
+#define SHIM_MAX_PDUS                   (1 << 16)
+#define SHIM_USEC_PER_TICK              (1000000 / configTICK_RATE_HZ)
+
+void app_main(void);
+
+struct ble_hs_cfg ble_hs_cfg;
+
+// Virtual time, in usec
+static int64_t now;
+
+// Hand over between the harness and the task thread
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static bool taskRunning;
+
+static struct {
+    void (*fn)(void *);
+    void *parms;
+    pthread_t thread;
+    bool created;
+    bool notified;
+    uint32_t value;
+    int64_t wakeAt;             // INT64_MAX: blocked forever
+    uint32_t resumes;
+} task;
+
+// Host event queue
+static struct ble_npl_event *evqHead;
+static struct ble_npl_event **evqTail = &evqHead;
+
+// Registered attributes, by handle
+struct Attr {
+    const struct ble_gatt_chr_def *chr;
+    bool cccd;
+    bool notify[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+    bool indicate[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+};
+
+static struct Attr attrs[SHIM_MAX_ATTRS];
+static uint16_t nextHandle = 1;
+
+static ble_gap_event_fn *gapCb;
+static void *gapCbArg;
+static bool advertising;
+static uint32_t advRefused;
+static uint16_t connHandles[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+static int nvsPersonality = -1;
+
+static struct ShimPdu *pdus;
+static int numPdus;
+
+// Called by the harness, to run the task until it blocks
+static void taskResume(void)
+{
+    pthread_mutex_lock(&lock);
+    task.resumes++;
+    taskRunning = true;
+    pthread_cond_broadcast(&cond);
+    while (taskRunning) {
+        pthread_cond_wait(&cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// Called by the task, to block until the harness resumes it
+static void taskYield(void)
+{
+    pthread_mutex_lock(&lock);
+    taskRunning = false;
+    pthread_cond_broadcast(&cond);
+    while (!taskRunning) {
+        pthread_cond_wait(&cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static void *taskEntry(void *arg)
+{
+    pthread_mutex_lock(&lock);
+    while (!taskRunning) {
+        pthread_cond_wait(&cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    task.fn(task.parms);
+
+    // A task function must not return
+    abort();
+}
+
+static void runReady(void)
+{
+    while (true) {
+        if (evqHead != NULL) {
+            struct ble_npl_event *ev = evqHead;
+
+            evqHead = ev->next;
+            if (evqHead == NULL) {
+                evqTail = &evqHead;
+            }
+            ev->queued = false;
+            ev->next = NULL;
+            ev->fn(ev);
+        } else if (task.created && task.notified) {
+            taskResume();
+        } else {
+            break;
+        }
+    }
+}
+
+static int connIndex(uint16_t connHandle)
+{
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+        if (connHandles[i] == connHandle) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void gapEvent(struct ble_gap_event *event)
+{
+    if (gapCb != NULL) {
+        gapCb(event, gapCbArg);
+    }
+}
+
+static void pduCapture(uint16_t connHandle, uint16_t attrHandle, bool indication, struct os_mbuf *om)
+{
+    struct ble_gap_event event = {
+        .type = BLE_GAP_EVENT_NOTIFY_TX,
+        .notify_tx = {
+            .conn_handle = connHandle,
+            .attr_handle = attrHandle,
+            .indication = indication,
+        },
+    };
+
+    if (pdus == NULL) {
+        pdus = calloc(SHIM_MAX_PDUS, sizeof(*pdus));
+    }
+    assert(numPdus < SHIM_MAX_PDUS);
+    assert(om->om_len <= SHIM_MAX_PAYLOAD);
+
+    struct ShimPdu *pdu = &pdus[numPdus++];
+    pdu->ts = now;
+    pdu->connHandle = connHandle;
+    pdu->attrHandle = attrHandle;
+    pdu->indication = indication;
+    pdu->len = om->om_len;
+    memcpy(pdu->data, om->om_data, om->om_len);
+    free(om);
+
+    // NimBLE reports notifications as sent once they are queued
+    // to the controller, and indications once they are acked;
+    // here both happen right away.
+    event.notify_tx.status = indication ? 14 /* BLE_HS_EDONE */ : 0;
+    gapEvent(&event);
+}
+
+// ESP-IDF
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    return (code == ESP_OK) ? "ESP_OK" : "ESP_FAIL";
+}
+
+void esp_restart(void)
+{
+    exit(0);
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return now;
+}
+
+esp_err_t esp_pm_configure(const void *config)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_sleep_enable_uart_wakeup(int uart_num)
+{
+    return ESP_OK;
+}
+
+esp_err_t uart_set_wakeup_threshold(int uart_num, int wakeup_threshold)
+{
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_init(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void)
+{
+    nvsPersonality = -1;
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    *out_handle = 1;
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char *key, uint8_t *out_value)
+{
+    if (nvsPersonality < 0) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    *out_value = nvsPersonality;
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char *key, uint8_t value)
+{
+    nvsPersonality = value;
+    return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+}
+
+esp_err_t esp_console_new_repl_uart(const esp_console_dev_uart_config_t *dev_config, const esp_console_repl_config_t *repl_config, esp_console_repl_t **ret_repl)
+{
+    *ret_repl = NULL;
+    return ESP_OK;
+}
+
+esp_err_t esp_console_register_help_command(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_console_cmd_register(const esp_console_cmd_t *cmd)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_console_start_repl(esp_console_repl_t *repl)
+{
+    return ESP_OK;
+}
+
+// FreeRTOS
+
+BaseType_t xTaskCreate(void (*fn)(void *), const char *name, uint32_t stackDepth, void *parms, int priority, TaskHandle_t *handle)
+{
+    assert(!task.created);
+
+    task.fn = fn;
+    task.parms = parms;
+    task.created = true;
+    task.wakeAt = INT64_MAX;
+    if (pthread_create(&task.thread, NULL, taskEntry, NULL) != 0) {
+        abort();
+    }
+    *handle = &task;
+
+    // Being of a higher priority, the task runs until it blocks
+    taskResume();
+
+    return pdPASS;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t) (now / SHIM_USEC_PER_TICK);
+}
+
+BaseType_t xTaskNotifyWait(uint32_t bitsToClearOnEntry, uint32_t bitsToClearOnExit, uint32_t *value, TickType_t timeout)
+{
+    if (!task.notified && (timeout != 0)) {
+        task.wakeAt = (timeout == portMAX_DELAY) ? INT64_MAX :
+                ((int64_t) xTaskGetTickCount() + timeout) * SHIM_USEC_PER_TICK;
+        taskYield();
+        task.wakeAt = INT64_MAX;
+    }
+
+    if (!task.notified) {
+        return pdFALSE;
+    }
+
+    task.notified = false;
+    *value = task.value & ~bitsToClearOnExit;
+    return pdTRUE;
+}
+
+BaseType_t xTaskNotify(TaskHandle_t handle, uint32_t value, eNotifyAction action)
+{
+    assert(action == eSetValueWithOverwrite);
+
+    task.value = value;
+    task.notified = true;
+
+    return pdPASS;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    assert(0);
+}
+
+// NimBLE: mbufs
+
+int os_mbuf_append(struct os_mbuf *om, const void *data, uint16_t len)
+{
+    uint16_t off = om->om_data - om->om_buf;
+
+    if (off + om->om_len + len > sizeof(om->om_buf)) {
+        return 1;
+    }
+    memcpy(om->om_data + om->om_len, data, len);
+    om->om_len += len;
+
+    return 0;
+}
+
+struct os_mbuf *ble_hs_mbuf_from_flat(const void *buf, uint16_t len)
+{
+    struct os_mbuf *om = malloc(sizeof(*om));
+
+    if (om != NULL) {
+        om->om_data = om->om_buf;
+        om->om_len = 0;
+        if (os_mbuf_append(om, buf, len) != 0) {
+            free(om);
+            om = NULL;
+        }
+    }
+
+    return om;
+}
+
+// NimBLE: UUIDs
+
+uint16_t ble_uuid_u16(const ble_uuid_t *uuid)
+{
+    return (uuid->type == BLE_UUID_TYPE_16) ? ((const ble_uuid16_t *) uuid)->value : 0;
+}
+
+int ble_uuid_cmp(const ble_uuid_t *uuid1, const ble_uuid_t *uuid2)
+{
+    if (uuid1->type != uuid2->type) {
+        return uuid1->type - uuid2->type;
+    }
+    if (uuid1->type == BLE_UUID_TYPE_16) {
+        return (int) ((const ble_uuid16_t *) uuid1)->value - (int) ((const ble_uuid16_t *) uuid2)->value;
+    }
+    return memcmp(((const ble_uuid128_t *) uuid1)->value, ((const ble_uuid128_t *) uuid2)->value, 16);
+}
+
+char *ble_uuid_to_str(const ble_uuid_t *uuid, char *dst)
+{
+    if (uuid->type == BLE_UUID_TYPE_16) {
+        sprintf(dst, "0x%04x", ((const ble_uuid16_t *) uuid)->value);
+    } else {
+        const uint8_t *u8 = ((const ble_uuid128_t *) uuid)->value;
+
+        sprintf(dst, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+                u8[15], u8[14], u8[13], u8[12], u8[11], u8[10], u8[9], u8[8],
+                u8[7], u8[6], u8[5], u8[4], u8[3], u8[2], u8[1], u8[0]);
+    }
+
+    return dst;
+}
+
+// NimBLE: GATT server
+
+int ble_gatts_count_cfg(const struct ble_gatt_svc_def *defs)
+{
+    return 0;
+}
+
+int ble_gatts_add_svcs(const struct ble_gatt_svc_def *svcs)
+{
+    for (const struct ble_gatt_svc_def *svc = svcs; svc->type != BLE_GATT_SVC_TYPE_END; svc++) {
+        struct ble_gatt_register_ctxt ctxt = {
+            .op = BLE_GATT_REGISTER_OP_SVC,
+            .svc = { .handle = nextHandle++, .svc_def = svc },
+        };
+
+        if (ble_hs_cfg.gatts_register_cb != NULL) {
+            ble_hs_cfg.gatts_register_cb(&ctxt, NULL);
+        }
+
+        for (const struct ble_gatt_chr_def *chr = svc->characteristics; chr->uuid != NULL; chr++) {
+            uint16_t defHandle = nextHandle++;
+            uint16_t valHandle = nextHandle++;
+
+            assert(nextHandle < SHIM_MAX_ATTRS - 1);
+            attrs[valHandle].chr = chr;
+            if (chr->flags & (BLE_GATT_CHR_F_NOTIFY | BLE_GATT_CHR_F_INDICATE)) {
+                attrs[valHandle].cccd = true;
+                nextHandle++;
+            }
+            if (chr->val_handle != NULL) {
+                *chr->val_handle = valHandle;
+            }
+
+            ctxt = (struct ble_gatt_register_ctxt) {
+                .op = BLE_GATT_REGISTER_OP_CHR,
+                .chr = { .def_handle = defHandle, .val_handle = valHandle, .chr_def = chr },
+            };
+            if (ble_hs_cfg.gatts_register_cb != NULL) {
+                ble_hs_cfg.gatts_register_cb(&ctxt, NULL);
+            }
+        }
+    }
+
+    return 0;
+}
+
+int ble_gatts_notify_custom(uint16_t conn_handle, uint16_t chr_val_handle, struct os_mbuf *om)
+{
+    pduCapture(conn_handle, chr_val_handle, false, om);
+    return 0;
+}
+
+int ble_gatts_indicate_custom(uint16_t conn_handle, uint16_t chr_val_handle, struct os_mbuf *om)
+{
+    pduCapture(conn_handle, chr_val_handle, true, om);
+    return 0;
+}
+
+void ble_svc_gap_init(void)
+{
+}
+
+void ble_svc_gatt_init(void)
+{
+}
+
+int ble_svc_gap_device_name_set(const char *name)
+{
+    return 0;
+}
+
+// NimBLE: GAP
+
+int ble_gap_adv_set_fields(const struct ble_hs_adv_fields *adv_fields)
+{
+    return 0;
+}
+
+int ble_gap_adv_start(uint8_t own_addr_type, const void *direct_addr, int32_t duration_ms, const struct ble_gap_adv_params *adv_params, ble_gap_event_fn *cb, void *cb_arg)
+{
+    if (advertising) {
+        return BLE_HS_EALREADY;
+    }
+    if (connIndex(BLE_HS_CONN_HANDLE_NONE) < 0) {
+        advRefused++;
+        return BLE_HS_ENOMEM;
+    }
+
+    gapCb = cb;
+    gapCbArg = cb_arg;
+    advertising = true;
+
+    return 0;
+}
+
+int ble_gap_adv_active(void)
+{
+    return advertising;
+}
+
+int ble_hs_id_infer_auto(int privacy, uint8_t *out_addr_type)
+{
+    *out_addr_type = 0;
+    return 0;
+}
+
+int ble_hs_id_copy_addr(uint8_t id_addr_type, uint8_t *out_id_addr, int *out_is_nrpa)
+{
+    static const uint8_t addr[6] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0xc6 };
+
+    memcpy(out_id_addr, addr, sizeof(addr));
+    return 0;
+}
+
+// NimBLE: host and port
+
+void ble_npl_event_init(struct ble_npl_event *ev, ble_npl_event_fn *fn, void *arg)
+{
+    memset(ev, 0, sizeof(*ev));
+    ev->fn = fn;
+    ev->arg = arg;
+}
+
+void ble_npl_eventq_put(struct ble_npl_eventq *evq, struct ble_npl_event *ev)
+{
+    if (ev->queued) {
+        return;
+    }
+    ev->queued = true;
+    ev->next = NULL;
+    *evqTail = ev;
+    evqTail = &ev->next;
+}
+
+struct ble_npl_eventq *nimble_port_get_dflt_eventq(void)
+{
+    return NULL;
+}
+
+esp_err_t nimble_port_init(void)
+{
+    return ESP_OK;
+}
+
+void nimble_port_run(void)
+{
+}
+
+// The harness thread stands in for the host task
+void nimble_port_freertos_init(void (*host_task_fn)(void *))
+{
+}
+
+void nimble_port_freertos_deinit(void)
+{
+}
+
+// Harness side
+
+void shimQuiet(bool quiet)
+{
+    static int savedStdout = -1;
+
+    fflush(stdout);
+    if (quiet && (savedStdout < 0)) {
+        int fd = open("/dev/null", O_WRONLY);
+
+        savedStdout = dup(STDOUT_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+    } else if (!quiet && (savedStdout >= 0)) {
+        dup2(savedStdout, STDOUT_FILENO);
+        close(savedStdout);
+        savedStdout = -1;
+    }
+}
+
+void shimSetNvsPersonality(int index)
+{
+    nvsPersonality = index;
+}
+
+void shimBoot(void)
+{
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+        connHandles[i] = BLE_HS_CONN_HANDLE_NONE;
+    }
+
+    app_main();
+    if (ble_hs_cfg.sync_cb != NULL) {
+        ble_hs_cfg.sync_cb();
+    }
+    runReady();
+}
+
+void shimRunUntil(int64_t ts)
+{
+    runReady();
+    while (task.created && (task.wakeAt <= ts)) {
+        if (task.wakeAt > now) {
+            now = task.wakeAt;
+        }
+        taskResume();
+        runReady();
+    }
+    if (ts > now) {
+        now = ts;
+    }
+}
+
+int64_t shimNow(void)
+{
+    return now;
+}
+
+uint32_t shimTaskResumes(void)
+{
+    return task.resumes;
+}
+
+bool shimAdvertising(void)
+{
+    return advertising;
+}
+
+uint32_t shimAdvRefused(void)
+{
+    return advRefused;
+}
+
+void shimConnect(uint16_t connHandle)
+{
+    int i = connIndex(BLE_HS_CONN_HANDLE_NONE);
+    struct ble_gap_event event = {
+        .type = BLE_GAP_EVENT_CONNECT,
+        .connect = { .status = 0, .conn_handle = connHandle },
+    };
+
+    assert(advertising && (i >= 0));
+    connHandles[i] = connHandle;
+    advertising = false;
+    gapEvent(&event);
+    runReady();
+}
+
+void shimDisconnect(uint16_t connHandle)
+{
+    int i = connIndex(connHandle);
+    struct ble_gap_event event = {
+        .type = BLE_GAP_EVENT_DISCONNECT,
+        .disconnect = { .reason = 0x213, .conn = { .conn_handle = connHandle } },
+    };
+
+    // NimBLE frees the connection before reporting it
+    assert(i >= 0);
+    connHandles[i] = BLE_HS_CONN_HANDLE_NONE;
+    gapEvent(&event);
+
+    // Subscriptions end with the connection
+    for (uint16_t handle = 1; handle < SHIM_MAX_ATTRS; handle++) {
+        struct Attr *attr = &attrs[handle];
+
+        if (attr->notify[i] || attr->indicate[i]) {
+            event = (struct ble_gap_event) {
+                .type = BLE_GAP_EVENT_SUBSCRIBE,
+                .subscribe = {
+                    .conn_handle = connHandle,
+                    .attr_handle = handle,
+                    .reason = 2 /* BLE_GAP_SUBSCRIBE_REASON_TERM */,
+                    .prev_notify = attr->notify[i],
+                    .prev_indicate = attr->indicate[i],
+                },
+            };
+            attr->notify[i] = attr->indicate[i] = false;
+            gapEvent(&event);
+        }
+    }
+
+    runReady();
+}
+
+void shimSubscribe(uint16_t connHandle, uint16_t attrHandle, bool notify, bool indicate)
+{
+    int i = connIndex(connHandle);
+    struct Attr *attr = &attrs[attrHandle];
+
+    assert((i >= 0) && (attrHandle < SHIM_MAX_ATTRS) && attr->cccd);
+    assert(!notify || (attr->chr->flags & BLE_GATT_CHR_F_NOTIFY));
+    assert(!indicate || (attr->chr->flags & BLE_GATT_CHR_F_INDICATE));
+
+    struct ble_gap_event event = {
+        .type = BLE_GAP_EVENT_SUBSCRIBE,
+        .subscribe = {
+            .conn_handle = connHandle,
+            .attr_handle = attrHandle,
+            .reason = 1 /* BLE_GAP_SUBSCRIBE_REASON_WRITE */,
+            .prev_notify = attr->notify[i],
+            .cur_notify = notify,
+            .prev_indicate = attr->indicate[i],
+            .cur_indicate = indicate,
+        },
+    };
+
+    attr->notify[i] = notify;
+    attr->indicate[i] = indicate;
+    gapEvent(&event);
+    runReady();
+}
+
+static int attrAccess(uint16_t connHandle, uint16_t attrHandle, uint8_t op, uint16_t flag, struct os_mbuf *om)
+{
+    const struct ble_gatt_chr_def *chr = (attrHandle < SHIM_MAX_ATTRS) ? attrs[attrHandle].chr : NULL;
+    struct ble_gatt_access_ctxt ctxt = {
+        .op = op,
+        .om = om,
+        .chr = chr,
+    };
+    int rc;
+
+    assert(connIndex(connHandle) >= 0);
+    if (chr == NULL) {
+        return 0x01;    // BLE_ATT_ERR_INVALID_HANDLE
+    }
+    if (!(chr->flags & flag)) {
+        return (op == BLE_GATT_ACCESS_OP_WRITE_CHR) ? BLE_ATT_ERR_WRITE_NOT_PERMITTED : 0x02;
+    }
+
+    rc = chr->access_cb(connHandle, attrHandle, &ctxt, chr->arg);
+    runReady();
+
+    return rc;
+}
+
+int shimWrite(uint16_t connHandle, uint16_t attrHandle, const void *data, uint16_t len)
+{
+    struct os_mbuf om = { .om_buf = { 0 } };
+
+    om.om_data = om.om_buf;
+    if (os_mbuf_append(&om, data, len) != 0) {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+
+    return attrAccess(connHandle, attrHandle, BLE_GATT_ACCESS_OP_WRITE_CHR, BLE_GATT_CHR_F_WRITE, &om);
+}
+
+int shimRead(uint16_t connHandle, uint16_t attrHandle, void *buf, uint16_t *len)
+{
+    struct os_mbuf om;
+    int rc;
+
+    om.om_data = om.om_buf;
+    om.om_len = 0;
+    rc = attrAccess(connHandle, attrHandle, BLE_GATT_ACCESS_OP_READ_CHR, BLE_GATT_CHR_F_READ, &om);
+    if (rc == 0) {
+        *len = (om.om_len < *len) ? om.om_len : *len;
+        memcpy(buf, om.om_data, *len);
+    }
+
+    return rc;
+}
+
+int shimNumPdus(void)
+{
+    return numPdus;
+}
+
+const struct ShimPdu *shimPdu(int index)
+{
+    return ((index >= 0) && (index < numPdus)) ? &pdus[index] : NULL;
+}
+
+void shimClearPdus(void)
+{
+    numPdus = 0;
+}
@@ -0,0 +1,439 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#pragma once
+
+// Thin host-side stand-in for the parts of ESP-IDF, FreeRTOS
+// and NimBLE used by the firmware in main/. Only the names and
+// fields the firmware touches are provided; their behavior is
+// implemented in shim.c on top of a virtual clock.
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ESP-IDF
+
+typedef int esp_err_t;
+
+#define ESP_OK                          0
+#define ESP_FAIL                        -1
+#define ESP_ERR_NVS_NOT_FOUND           0x1102
+#define ESP_ERR_NVS_NO_FREE_PAGES       0x110d
+#define ESP_ERR_NVS_NEW_VERSION_FOUND   0x1110
+
+#define ESP_ERROR_CHECK(x) do {                                         \
+        esp_err_t rc_ = (x);                                            \
+        if (rc_ != ESP_OK) {                                            \
+            fprintf(stderr, "%s:%d: %s failed: %d\n", __FILE__, __LINE__, #x, rc_); \
+            abort();                                                    \
+        }                                                               \
+    } while (0)
+
+#define ESP_LOGE(tag, fmt, ...) printf("E %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) printf("W %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) printf("I %s: " fmt "\n", tag, ##__VA_ARGS__)
+
+const char *esp_err_to_name(esp_err_t code);
+void esp_restart(void);
+int64_t esp_timer_get_time(void);
+
+typedef struct {
+    int max_freq_mhz;
+    int min_freq_mhz;
+    bool light_sleep_enable;
+} esp_pm_config_t;
+
+esp_err_t esp_pm_configure(const void *config);
+esp_err_t esp_sleep_enable_uart_wakeup(int uart_num);
+esp_err_t uart_set_wakeup_threshold(int uart_num, int wakeup_threshold);
+
+typedef uint32_t nvs_handle_t;
+typedef enum {
+    NVS_READONLY,
+    NVS_READWRITE,
+} nvs_open_mode_t;
+
+esp_err_t nvs_flash_init(void);
+esp_err_t nvs_flash_erase(void);
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle);
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char *key, uint8_t *out_value);
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char *key, uint8_t value);
+esp_err_t nvs_commit(nvs_handle_t handle);
+void nvs_close(nvs_handle_t handle);
+
+typedef struct {
+    const char *prompt;
+} esp_console_repl_config_t;
+
+typedef struct {
+    int channel;
+} esp_console_dev_uart_config_t;
+
+typedef struct esp_console_repl_s esp_console_repl_t;
+
+typedef struct {
+    const char *command;
+    const char *help;
+    const char *hint;
+    int (*func)(int argc, char **argv);
+} esp_console_cmd_t;
+
+#define ESP_CONSOLE_REPL_CONFIG_DEFAULT() { .prompt = NULL }
+#define ESP_CONSOLE_DEV_UART_CONFIG_DEFAULT() { .channel = 0 }
+
+esp_err_t esp_console_new_repl_uart(const esp_console_dev_uart_config_t *dev_config, const esp_console_repl_config_t *repl_config, esp_console_repl_t **ret_repl);
+esp_err_t esp_console_register_help_command(void);
+esp_err_t esp_console_cmd_register(const esp_console_cmd_t *cmd);
+esp_err_t esp_console_start_repl(esp_console_repl_t *repl);
+
+// FreeRTOS
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef void *TaskHandle_t;
+typedef int portMUX_TYPE;
+
+#define pdTRUE                          1
+#define pdFALSE                         0
+#define pdPASS                          1
+#define portMAX_DELAY                   ((TickType_t) 0xffffffff)
+#define configMAX_PRIORITIES            25
+#define configTICK_RATE_HZ              CONFIG_FREERTOS_HZ
+#define pdMS_TO_TICKS(ms)               ((TickType_t) (((uint64_t) (ms) * configTICK_RATE_HZ) / 1000))
+
+// Only one task runs at a time under the virtual clock, so
+// critical sections need no locking.
+#define portMUX_INITIALIZER_UNLOCKED    0
+#define taskENTER_CRITICAL(mux)         ((void) (mux))
+#define taskEXIT_CRITICAL(mux)          ((void) (mux))
+
+typedef enum {
+    eNoAction,
+    eSetBits,
+    eIncrement,
+    eSetValueWithOverwrite,
+    eSetValueWithoutOverwrite,
+} eNotifyAction;
+
+BaseType_t xTaskCreate(void (*task)(void *), const char *name, uint32_t stackDepth, void *parms, int priority, TaskHandle_t *handle);
+TickType_t xTaskGetTickCount(void);
+BaseType_t xTaskNotifyWait(uint32_t bitsToClearOnEntry, uint32_t bitsToClearOnExit, uint32_t *value, TickType_t timeout);
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action);
+void vTaskDelay(TickType_t ticks);
+
+// NimBLE: logging
+
+#define MODLOG_DFLT(level, fmt, ...) printf(#level ": " fmt "\n", ##__VA_ARGS__)
+
+// NimBLE: mbufs
+
+struct os_mbuf {
+    uint8_t *om_data;
+    uint16_t om_len;
+    uint8_t om_buf[256];
+};
+
+int os_mbuf_append(struct os_mbuf *om, const void *data, uint16_t len);
+struct os_mbuf *ble_hs_mbuf_from_flat(const void *buf, uint16_t len);
+
+// NimBLE: UUIDs
+
+enum {
+    BLE_UUID_TYPE_16 = 16,
+    BLE_UUID_TYPE_32 = 32,
+    BLE_UUID_TYPE_128 = 128,
+};
+
+typedef struct {
+    uint8_t type;
+} ble_uuid_t;
+
+typedef struct {
+    ble_uuid_t u;
+    uint16_t value;
+} ble_uuid16_t;
+
+typedef struct {
+    ble_uuid_t u;
+    uint8_t value[16];
+} ble_uuid128_t;
+
+#define BLE_UUID16_INIT(uuid16) { .u = { .type = BLE_UUID_TYPE_16 }, .value = (uuid16) }
+#define BLE_UUID128_INIT(...) { .u = { .type = BLE_UUID_TYPE_128 }, .value = { __VA_ARGS__ } }
+#define BLE_UUID16_DECLARE(uuid16) ((ble_uuid_t *) (&(ble_uuid16_t) BLE_UUID16_INIT(uuid16)))
+#define BLE_UUID128_DECLARE(...) ((ble_uuid_t *) (&(ble_uuid128_t) BLE_UUID128_INIT(__VA_ARGS__)))
+#define BLE_UUID_STR_LEN                37
+
+uint16_t ble_uuid_u16(const ble_uuid_t *uuid);
+int ble_uuid_cmp(const ble_uuid_t *uuid1, const ble_uuid_t *uuid2);
+char *ble_uuid_to_str(const ble_uuid_t *uuid, char *dst);
+
+// NimBLE: GATT server
+
+#define BLE_ATT_ERR_WRITE_NOT_PERMITTED         0x03
+#define BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN      0x0d
+#define BLE_ATT_ERR_UNLIKELY                    0x0e
+#define BLE_ATT_ERR_INSUFFICIENT_RES            0x11
+
+#define BLE_GATT_ACCESS_OP_READ_CHR     0
+#define BLE_GATT_ACCESS_OP_WRITE_CHR    1
+#define BLE_GATT_ACCESS_OP_READ_DSC     2
+#define BLE_GATT_ACCESS_OP_WRITE_DSC    3
+
+#define BLE_GATT_CHR_F_READ             0x0002
+#define BLE_GATT_CHR_F_WRITE            0x0008
+#define BLE_GATT_CHR_F_NOTIFY           0x0010
+#define BLE_GATT_CHR_F_INDICATE         0x0020
+
+#define BLE_GATT_SVC_TYPE_END           0
+#define BLE_GATT_SVC_TYPE_PRIMARY       1
+
+#define BLE_GATT_REGISTER_OP_SVC        1
+#define BLE_GATT_REGISTER_OP_CHR        2
+#define BLE_GATT_REGISTER_OP_DSC        3
+
+struct ble_gatt_access_ctxt;
+
+typedef int ble_gatt_access_fn(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+
+struct ble_gatt_chr_def {
+    const ble_uuid_t *uuid;
+    ble_gatt_access_fn *access_cb;
+    void *arg;
+    void *descriptors;
+    uint16_t flags;
+    uint8_t min_key_size;
+    uint16_t *val_handle;
+};
+
+struct ble_gatt_svc_def {
+    uint8_t type;
+    const ble_uuid_t *uuid;
+    const struct ble_gatt_svc_def **includes;
+    const struct ble_gatt_chr_def *characteristics;
+};
+
+struct ble_gatt_dsc_def {
+    const ble_uuid_t *uuid;
+};
+
+struct ble_gatt_access_ctxt {
+    uint8_t op;
+    struct os_mbuf *om;
+    union {
+        const struct ble_gatt_chr_def *chr;
+        const struct ble_gatt_dsc_def *dsc;
+    };
+};
+
+struct ble_gatt_register_ctxt {
+    uint8_t op;
+    union {
+        struct {
+            uint16_t handle;
+            const struct ble_gatt_svc_def *svc_def;
+        } svc;
+        struct {
+            uint16_t def_handle;
+            uint16_t val_handle;
+            const struct ble_gatt_chr_def *chr_def;
+        } chr;
+        struct {
+            uint16_t handle;
+            const struct ble_gatt_dsc_def *dsc_def;
+        } dsc;
+    };
+};
+
+int ble_gatts_count_cfg(const struct ble_gatt_svc_def *defs);
+int ble_gatts_add_svcs(const struct ble_gatt_svc_def *svcs);
+int ble_gatts_notify_custom(uint16_t conn_handle, uint16_t chr_val_handle, struct os_mbuf *om);
+int ble_gatts_indicate_custom(uint16_t conn_handle, uint16_t chr_val_handle, struct os_mbuf *om);
+
+void ble_svc_gap_init(void);
+void ble_svc_gatt_init(void);
+int ble_svc_gap_device_name_set(const char *name);
+
+// NimBLE: GAP
+
+#define BLE_HS_EALREADY                 2
+#define BLE_HS_EINVAL                   3
+#define BLE_HS_ENOMEM                   6
+#define BLE_HS_FOREVER                  INT32_MAX
+#define BLE_HS_CONN_HANDLE_NONE         0xffff
+
+#define BLE_HS_ADV_F_DISC_GEN           0x02
+#define BLE_HS_ADV_F_BREDR_UNSUP        0x04
+#define BLE_HS_ADV_TX_PWR_LVL_AUTO      (-128)
+
+#define BLE_GAP_CONN_MODE_UND           2
+#define BLE_GAP_DISC_MODE_GEN           2
+
+#define BLE_GAP_EVENT_CONNECT           0
+#define BLE_GAP_EVENT_DISCONNECT        1
+#define BLE_GAP_EVENT_ADV_COMPLETE      9
+#define BLE_GAP_EVENT_NOTIFY_TX         13
+#define BLE_GAP_EVENT_SUBSCRIBE         14
+#define BLE_GAP_EVENT_MTU               15
+
+struct ble_gap_conn_desc {
+    uint16_t conn_handle;
+};
+
+struct ble_gap_event {
+    uint8_t type;
+    union {
+        struct {
+            int status;
+            uint16_t conn_handle;
+        } connect;
+        struct {
+            int reason;
+            struct ble_gap_conn_desc conn;
+        } disconnect;
+        struct {
+            uint16_t conn_handle;
+            uint16_t attr_handle;
+            uint8_t reason;
+            uint8_t prev_notify:1;
+            uint8_t cur_notify:1;
+            uint8_t prev_indicate:1;
+            uint8_t cur_indicate:1;
+        } subscribe;
+        struct {
+            uint16_t conn_handle;
+            uint16_t channel_id;
+            uint16_t value;
+        } mtu;
+        struct {
+            int status;
+            uint16_t conn_handle;
+            uint16_t attr_handle;
+            uint8_t indication:1;
+        } notify_tx;
+    };
+};
+
+typedef int ble_gap_event_fn(struct ble_gap_event *event, void *arg);
+
+struct ble_hs_adv_fields {
+    uint8_t flags;
+    const uint8_t *name;
+    uint8_t name_len;
+    unsigned name_is_complete:1;
+    int8_t tx_pwr_lvl;
+    unsigned tx_pwr_lvl_is_present:1;
+    const ble_uuid16_t *uuids16;
+    uint8_t num_uuids16;
+    unsigned uuids16_is_complete:1;
+};
+
+struct ble_gap_adv_params {
+    uint8_t conn_mode;
+    uint8_t disc_mode;
+};
+
+int ble_gap_adv_set_fields(const struct ble_hs_adv_fields *adv_fields);
+int ble_gap_adv_start(uint8_t own_addr_type, const void *direct_addr, int32_t duration_ms, const struct ble_gap_adv_params *adv_params, ble_gap_event_fn *cb, void *cb_arg);
+int ble_gap_adv_active(void);
+int ble_hs_id_infer_auto(int privacy, uint8_t *out_addr_type);
+int ble_hs_id_copy_addr(uint8_t id_addr_type, uint8_t *out_id_addr, int *out_is_nrpa);
+
+// NimBLE: host and port
+
+typedef void ble_hs_sync_fn(void);
+typedef void ble_hs_reset_fn(int reason);
+typedef void ble_gatt_register_fn(struct ble_gatt_register_ctxt *ctxt, void *arg);
+
+struct ble_hs_cfg {
+    ble_hs_sync_fn *sync_cb;
+    ble_hs_reset_fn *reset_cb;
+    ble_gatt_register_fn *gatts_register_cb;
+};
+
+extern struct ble_hs_cfg ble_hs_cfg;
+
+struct ble_npl_event;
+typedef void ble_npl_event_fn(struct ble_npl_event *ev);
+
+struct ble_npl_event {
+    ble_npl_event_fn *fn;
+    void *arg;
+    bool queued;
+    struct ble_npl_event *next;
+};
+
+struct ble_npl_eventq;
+
+void ble_npl_event_init(struct ble_npl_event *ev, ble_npl_event_fn *fn, void *arg);
+void ble_npl_eventq_put(struct ble_npl_eventq *evq, struct ble_npl_event *ev);
+struct ble_npl_eventq *nimble_port_get_dflt_eventq(void);
+
+esp_err_t nimble_port_init(void);
+void nimble_port_run(void);
+void nimble_port_freertos_init(void (*host_task_fn)(void *));
+void nimble_port_freertos_deinit(void);
+
+// Harness side: virtual clock, traffic injection and capture
+
+#define SHIM_MAX_PAYLOAD                32
+
+struct ShimPdu {
+    int64_t ts;                 // virtual usec
+    uint16_t connHandle;
+    uint16_t attrHandle;
+    bool indication;
+    uint16_t len;
+    uint8_t data[SHIM_MAX_PAYLOAD];
+};
+
+void shimQuiet(bool quiet);
+void shimSetNvsPersonality(int index);  // -1: key not present
+
+void shimBoot(void);                    // app_main() + host sync
+void shimRunUntil(int64_t ts);          // virtual usec
+int64_t shimNow(void);
+uint32_t shimTaskResumes(void);
+
+bool shimAdvertising(void);
+uint32_t shimAdvRefused(void);         // ble_gap_adv_start() refusals
+void shimConnect(uint16_t connHandle);
+void shimDisconnect(uint16_t connHandle);
+void shimSubscribe(uint16_t connHandle, uint16_t attrHandle, bool notify, bool indicate);
+int shimWrite(uint16_t connHandle, uint16_t attrHandle, const void *data, uint16_t len);
+int shimRead(uint16_t connHandle, uint16_t attrHandle, void *buf, uint16_t *len);
+
+int shimNumPdus(void);
+const struct ShimPdu *shimPdu(int index);
+void shimClearPdus(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,229 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+// Micro-benchmarks of the firmware hot paths, run on the host.
+// Each one reports ns/op, the best of a few rounds, and is
+// compared to the stored baseline: a result slower than the
+// baseline by more than BENCH_TOLERANCE fails the run. Results
+// are first scaled by how fast a fixed calibration loop ran,
+// compared to when the baseline was recorded, so that a slower
+// or busier machine doesn't read as a regression.
+//
+//   sim_bench <baseline file> [--update]
+//
+// --update rewrites the baseline with the current results.
+
+#include <time.h>
+#include "shim.h"
+#include "ble.h"
+
+#define BENCH_ROUNDS            5
+#define BENCH_TOLERANCE         3.0
+#define BENCH_MAX_RESULTS       8
+
+struct Bench {
+    const char *name;
+    void (*fn)(uint32_t iterations);
+    uint32_t iterations;
+};
+
+struct Result {
+    char name[32];
+    double nsPerOp;
+};
+
+static volatile uint32_t sink;
+static const uint8_t fecTargetPowerMsg[FEC_MSG_LEN] = {
+    FEC_SYNC, FEC_MSG_DATA_LEN, FEC_MSG_ACKNOWLEDGED_DATA, 0x05,
+    FEC_PAGE_TARGET_POWER, 0xff, 0xff, 0xff, 0xff, 0xff, 0xb0, 0x04, 0x9d,
+};   // 300W
+
+static int64_t nsNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Fixed work, independent of the firmware: an xorshift chain
+static void benchCalibrate(uint32_t iterations)
+{
+    uint32_t x = 2463534242;
+
+    for (uint32_t i = 0; i < iterations; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+    }
+    sink = x;
+}
+
+// One CPM notification payload: encode, then apply a view
+static void benchCpmEncode(uint32_t iterations)
+{
+    struct SimState sim = { .targetPower = 225 };
+    struct CpmView view = { .mask = CPM_MASK_PEDAL_POWER_BALANCE };
+    struct CpmState state = { 0 };
+    uint8_t buf[sizeof (struct CpmData)];
+    struct CpmData cpmData;
+    uint32_t sum = 0;
+
+    for (uint32_t i = 0; i < iterations; i++) {
+        sim.targetPower = i & 0x3ff;
+        cpmEncode(&cpmData, &state, &sim);
+        sum += cpmView(buf, &cpmData, &view) + buf[2];
+    }
+    sink = sum;
+}
+
+static void benchFecParse(uint32_t iterations)
+{
+    struct SimState sim = { 0 };
+    uint32_t sum = 0;
+
+    for (uint32_t i = 0; i < iterations; i++) {
+        sum += fecParse(fecTargetPowerMsg, sizeof(fecTargetPowerMsg), &sim) + sim.targetPower;
+    }
+    sink = sum;
+}
+
+// A control write, through the FE-C characteristic's access
+// callback, as the NimBLE host task would invoke it
+static void benchFecAccess(uint32_t iterations)
+{
+    uint32_t sum = 0;
+
+    shimQuiet(true);
+    for (uint32_t i = 0; i < iterations; i++) {
+        sum += shimWrite(1, fec3ChrHandle, fecTargetPowerMsg, sizeof(fecTargetPowerMsg));
+    }
+    shimQuiet(false);
+    sink = sum;
+}
+
+// The calibration loop comes first
+static const struct Bench benches[] = {
+    { "calibrate", benchCalibrate, 10000000 },
+    { "cpmEncode", benchCpmEncode, 1000000 },
+    { "fecParse", benchFecParse, 1000000 },
+    { "fecAccess", benchFecAccess, 100000 },
+};
+
+#define NUM_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+static int baselineLoad(const char *path, struct Result *results)
+{
+    FILE *fp = fopen(path, "r");
+    char line[128];
+    int n = 0;
+
+    if (fp == NULL) {
+        return 0;
+    }
+    while ((n < BENCH_MAX_RESULTS) && (fgets(line, sizeof(line), fp) != NULL)) {
+        if ((line[0] != '#') && (sscanf(line, "%31s %lf", results[n].name, &results[n].nsPerOp) == 2)) {
+            n++;
+        }
+    }
+    fclose(fp);
+
+    return n;
+}
+
+static int baselineSave(const char *path, const struct Result *results, int n)
+{
+    FILE *fp = fopen(path, "w");
+
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    fprintf(fp, "# name ns/op, as written by sim_bench --update\n");
+    for (int i = 0; i < n; i++) {
+        fprintf(fp, "%s %.2f\n", results[i].name, results[i].nsPerOp);
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct Result baseline[BENCH_MAX_RESULTS];
+    struct Result results[NUM_BENCHES];
+    int numBaseline;
+    bool update;
+    double scale = 1.0;
+    int failed = 0;
+
+    if ((argc < 2) || (argc > 3) || ((argc == 3) && (strcmp(argv[2], "--update") != 0))) {
+        fprintf(stderr, "usage: %s <baseline file> [--update]\n", argv[0]);
+        return 2;
+    }
+    update = (argc == 3);
+    numBaseline = baselineLoad(argv[1], baseline);
+
+    shimQuiet(true);
+    shimBoot();
+    shimConnect(1);
+    shimQuiet(false);
+
+    for (int i = 0; i < (int) NUM_BENCHES; i++) {
+        const struct Bench *bench = &benches[i];
+        double best = 0;
+
+        for (int round = 0; round < BENCH_ROUNDS; round++) {
+            int64_t start = nsNow();
+            double nsPerOp;
+
+            bench->fn(bench->iterations);
+            nsPerOp = (double) (nsNow() - start) / bench->iterations;
+            if ((round == 0) || (nsPerOp < best)) {
+                best = nsPerOp;
+            }
+        }
+
+        snprintf(results[i].name, sizeof(results[i].name), "%s", bench->name);
+        results[i].nsPerOp = best;
+        printf("%-12s %10.2f ns/op", bench->name, best);
+
+        for (int j = 0; j < numBaseline; j++) {
+            if (strcmp(baseline[j].name, bench->name) == 0) {
+                if (bench->fn == benchCalibrate) {
+                    scale = baseline[j].nsPerOp / best;
+                    printf("  baseline %10.2f ns/op  scale %.2f", baseline[j].nsPerOp, scale);
+                } else {
+                    bool regressed = (best * scale > baseline[j].nsPerOp * BENCH_TOLERANCE);
+
+                    printf("  baseline %10.2f ns/op  scaled %10.2f ns/op%s",
+                            baseline[j].nsPerOp, best * scale, regressed ? "  REGRESSION" : "");
+                    failed |= regressed;
+                }
+            }
+        }
+        printf("\n");
+    }
+
+    if (update) {
+        return (baselineSave(argv[1], results, NUM_BENCHES) == 0) ? 0 : 1;
+    }
+
+    return failed ? 1 : 0;
+}
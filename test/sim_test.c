@@ -0,0 +1,339 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+// Functional tests for the firmware in main/, run on the host
+// against the shim in shim/ under a virtual clock.
+//
+//   sim_test codec|personality|ride
+
+#include "shim.h"
+#include "ble.h"
+
+#define SEC                     1000000LL       // usec
+
+#define CHECK(cond) do {                                                \
+        if (!(cond)) {                                                  \
+            shimQuiet(false);                                           \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                    \
+        }                                                               \
+    } while (0)
+
+// Build an FE-C acknowledged data message, with its checksum
+static void fecMsg(uint8_t *msg, uint8_t page, const uint8_t *data)
+{
+    uint8_t checksum = 0;
+
+    msg[0] = FEC_SYNC;
+    msg[1] = FEC_MSG_DATA_LEN;
+    msg[2] = FEC_MSG_ACKNOWLEDGED_DATA;
+    msg[3] = 0x05;
+    msg[4] = page;
+    memcpy(&msg[5], data, 7);
+    for (int i = 0; i < (FEC_MSG_LEN - 1); i++) {
+        checksum ^= msg[i];
+    }
+    msg[FEC_MSG_LEN - 1] = checksum;
+}
+
+static void fecTargetPower(uint8_t *msg, uint16_t watts)
+{
+    uint8_t data[7] = { 0xff, 0xff, 0xff, 0xff, 0xff };
+
+    putUINT16(&data[5], watts * 4);
+    fecMsg(msg, FEC_PAGE_TARGET_POWER, data);
+}
+
+// Count the captured PDUs sent to a connection on a handle, and
+// return the last one
+static int pduCount(uint16_t connHandle, uint16_t attrHandle, const struct ShimPdu **last)
+{
+    int count = 0;
+
+    for (int i = 0; i < shimNumPdus(); i++) {
+        const struct ShimPdu *pdu = shimPdu(i);
+
+        if ((pdu->connHandle == connHandle) && (pdu->attrHandle == attrHandle)) {
+            count++;
+            if (last != NULL) {
+                *last = pdu;
+            }
+        }
+    }
+
+    return count;
+}
+
+static void testCodec(void)
+{
+    uint8_t buf[sizeof (struct CpmData)];
+    struct CpmState state = { 0 };
+    struct SimState sim = { .targetPower = 225 };
+    struct CpmView view = { 0 };
+    struct CpmData cpmData;
+    uint8_t msg[FEC_MSG_LEN];
+
+    // Helpers are little endian, and sign extend
+    putUINT24(buf, 0x123456);
+    CHECK((buf[0] == 0x56) && (buf[1] == 0x34) && (buf[2] == 0x12));
+    CHECK(getUINT24(buf) == 0x123456);
+    putSINT24(buf, -2);
+    CHECK(getSINT24(buf) == -2);
+    CHECK(getUINT24(buf) == 0xfffffe);
+    putSINT16(buf, -300);
+    CHECK(getSINT16(buf) == -300);
+    putUINT32(buf, 0xdeadbeef);
+    CHECK(getUINT32(buf) == 0xdeadbeef);
+
+    // A full measurement, then masked views of it
+    cpmEncode(&cpmData, &state, &sim);
+    CHECK(getUINT16(cpmData.flags) == (CPM_PEDAL_POWER_BALANCE | CPM_PEDAL_POWER_BALANCE_REFERENCE | CPM_CRANK_REVOLUTION_DATA));
+    CHECK(getSINT16(cpmData.instPower) == 225);
+    CHECK((state.cumulativeCrankRevolutions == 2) && (state.lastCrankEventTime == 1024));
+
+    CHECK(cpmView(buf, &cpmData, &view) == 9);
+    CHECK(getUINT16(&buf[5]) == 2);
+
+    view.crankRevOffset = 2;
+    view.crankTimeOffset = 1024;
+    CHECK(cpmView(buf, &cpmData, &view) == 9);
+    CHECK((getUINT16(&buf[5]) == 0) && (getUINT16(&buf[7]) == 0));
+
+    view.mask = CPM_MASK_PEDAL_POWER_BALANCE;
+    CHECK(cpmView(buf, &cpmData, &view) == 8);
+    CHECK(getUINT16(buf) == CPM_CRANK_REVOLUTION_DATA);
+
+    view.mask = CPM_MASK_PEDAL_POWER_BALANCE | CPM_MASK_CRANK_REVOLUTION_DATA;
+    CHECK(cpmView(buf, &cpmData, &view) == 4);
+    CHECK(getUINT16(buf) == 0);
+    CHECK(getSINT16(&buf[2]) == 225);
+
+    CHECK(cpmFeatureMask(CPF_PEDAL_POWER_BALANCE | CPF_CRANK_REVOLUTION_DATA) == 0);
+    CHECK(cpmFeatureMask(CPF_CRANK_REVOLUTION_DATA) == CPM_MASK_PEDAL_POWER_BALANCE);
+
+    // FE-C: target power, and what must be rejected
+    fecTargetPower(msg, 300);
+    CHECK(fecParse(msg, sizeof(msg), &sim) == FEC_PAGE_TARGET_POWER);
+    CHECK(sim.targetPower == 300);
+
+    CHECK(fecParse(msg, sizeof(msg) - 1, &sim) == -1);
+    msg[FEC_MSG_LEN - 1] ^= 0x01;
+    CHECK(fecParse(msg, sizeof(msg), &sim) == -1);
+    fecTargetPower(msg, 300);
+    msg[1] = 8;
+    CHECK(fecParse(msg, sizeof(msg), &sim) == -1);
+    fecTargetPower(msg, 300);
+    msg[0] = 0;
+    CHECK(fecParse(msg, sizeof(msg), &sim) == -1);
+}
+
+static void testPersonality(void)
+{
+    const struct ShimPdu *pdu = NULL;
+
+    for (int i = 0; i < numPersonalities; i++) {
+        CHECK(personalityCheck(&personalities[i]) == 0);
+        CHECK(strlen(personalities[i].deviceName) <= ADV_MAX_NAME_LEN);
+    }
+
+    // The last one has no pedal power balance, nor FE-C
+    shimSetNvsPersonality(numPersonalities - 1);
+    shimBoot();
+    CHECK(fec3ChrHandle == 0);
+
+    shimConnect(1);
+    shimSubscribe(1, cpsCpmHandle, true, false);
+    CHECK(pduCount(1, cpsCpmHandle, &pdu) == 1);
+    CHECK(pdu->len == 8);
+    CHECK(getUINT16(pdu->data) == CPM_CRANK_REVOLUTION_DATA);
+}
+
+static void testRide(void)
+{
+    // Data Page 70: request Data Page 51, once, as an ack
+    static const uint8_t requestDataPage[7] = { 0xff, 0xff, 0xff, 0xff, 0x01, 0x33, 0x01 };
+    const struct ShimPdu *pdu = NULL;
+    uint8_t msg[FEC_MSG_LEN];
+    uint8_t rsp[3];
+    uint32_t queued, hostTx;
+    uint32_t resumes;
+    int64_t start;
+    int count;
+
+    // A key out of range falls back to the first personality
+    shimSetNvsPersonality(numPersonalities);
+    shimBoot();
+    CHECK(shimAdvertising());
+    CHECK(fec3ChrHandle != 0);
+
+    // Nobody subscribed: the task stays blocked
+    resumes = shimTaskResumes();
+    shimRunUntil(10 * SEC);
+    CHECK(shimTaskResumes() == resumes);
+    CHECK(shimNumPdus() == 0);
+
+    // First client: notified at once, then every second
+    shimConnect(1);
+    CHECK(shimAdvertising());
+    shimSubscribe(1, cpsCpHandle, false, true);
+    shimSubscribe(1, cpsCpmHandle, true, false);
+    start = shimNow();
+    shimRunUntil(start + 10 * SEC);
+    CHECK(pduCount(1, cpsCpmHandle, &pdu) == 11);
+    for (int i = 0; i < shimNumPdus(); i++) {
+        CHECK(shimPdu(i)->ts == start + i * SEC);
+        CHECK(shimPdu(i)->len == 9);
+        CHECK(getSINT16(&shimPdu(i)->data[2]) == 225);
+        CHECK(getUINT16(&shimPdu(i)->data[5]) == 2 * i);
+        CHECK(getUINT16(&shimPdu(i)->data[7]) == 1024 * i);
+    }
+
+    // It takes control with FE-C
+    fecTargetPower(msg, 300);
+    CHECK(shimWrite(1, fec3ChrHandle, msg, sizeof(msg)) == 0);
+    shimRunUntil(start + 11 * SEC);
+    CHECK(pduCount(1, cpsCpmHandle, &pdu) == 12);
+    CHECK(getSINT16(&pdu->data[2]) == 300);
+
+    // ... and the first notification reflecting it measures the
+    // latency of that write, once
+    CHECK(latencyCounts(1, &queued, &hostTx));
+    CHECK((queued == 1) && (hostTx == 1));
+
+    // Second client: can't take control, but can mask its view,
+    // which starts from zero
+    shimClearPdus();
+    shimConnect(2);
+    fecTargetPower(msg, 100);
+    CHECK(shimWrite(2, fec3ChrHandle, msg, sizeof(msg)) == BLE_ATT_ERR_WRITE_NOT_PERMITTED);
+    msg[FEC_MSG_LEN - 1] ^= 0x01;
+    CHECK(shimWrite(2, fec3ChrHandle, msg, sizeof(msg)) == 0);
+
+    shimSubscribe(2, cpsCpmHandle, true, false);
+    shimRunUntil(start + 12 * SEC);
+    CHECK(pduCount(2, cpsCpmHandle, &pdu) == 1);
+    CHECK(pdu->len == 9);
+    CHECK(getSINT16(&pdu->data[2]) == 300);
+    CHECK((getUINT16(&pdu->data[5]) == 0) && (getUINT16(&pdu->data[7]) == 0));
+
+    rsp[0] = CPS_CP_MASK_CPM_CONTENT;
+    putUINT16(&rsp[1], CPM_MASK_CRANK_REVOLUTION_DATA);
+    CHECK(shimWrite(2, cpsCpHandle, rsp, sizeof(rsp)) == ATT_ERR_CCCD_IMPROPERLY_CONFIGURED);
+    shimSubscribe(2, cpsCpHandle, false, true);
+    CHECK(shimWrite(2, cpsCpHandle, rsp, sizeof(rsp)) == 0);
+    CHECK(pduCount(2, cpsCpHandle, &pdu) == 1);
+    CHECK(pdu->indication && (pdu->len == 3));
+    CHECK((pdu->data[0] == CPS_CP_RESPONSE_CODE) && (pdu->data[1] == CPS_CP_MASK_CPM_CONTENT) && (pdu->data[2] == CPS_CP_SUCCESS));
+
+    shimRunUntil(start + 13 * SEC);
+    CHECK(pduCount(2, cpsCpmHandle, &pdu) == 2);
+    CHECK(pdu->len == 5);
+    CHECK(pduCount(1, cpsCpmHandle, &pdu) == 2);
+    CHECK(pdu->len == 9);
+    CHECK(getUINT16(&pdu->data[5]) == 2 * 13);
+
+    // Rejected writes are not measured
+    CHECK(latencyCounts(1, &queued, &hostTx) && (queued == 1));
+    CHECK(latencyCounts(2, &queued, &hostTx) && (queued == 0) && (hostTx == 0));
+
+    // Control is released on disconnect, and writes that change
+    // nothing don't take it
+    shimDisconnect(1);
+    CHECK(shimAdvertising());
+    rsp[0] = 0x0c;      // Start Offset Compensation
+    CHECK(shimWrite(2, cpsCpHandle, rsp, 1) == 0);
+    CHECK(pduCount(2, cpsCpHandle, &pdu) == 2);
+    CHECK((pdu->data[1] == 0x0c) && (pdu->data[2] == CPS_CP_OP_CODE_NOT_SUPPORTED));
+    fecMsg(msg, 0x46, requestDataPage);
+    CHECK(shimWrite(2, fec3ChrHandle, msg, sizeof(msg)) == 0);
+    shimRunUntil(start + 14 * SEC);
+    CHECK(latencyCounts(2, &queued, &hostTx) && (queued == 0));
+
+    // A writer not subscribed to the CPM is not measured either,
+    // even once it subscribes
+    shimConnect(1);
+    fecTargetPower(msg, 100);
+    CHECK(shimWrite(1, fec3ChrHandle, msg, sizeof(msg)) == 0);
+    CHECK(shimWrite(2, fec3ChrHandle, msg, sizeof(msg)) == BLE_ATT_ERR_WRITE_NOT_PERMITTED);
+    shimSubscribe(1, cpsCpmHandle, true, false);
+    shimRunUntil(start + 16 * SEC);
+    CHECK(latencyCounts(1, &queued, &hostTx) && (queued == 0));
+
+    // Advertising stops while all the connections are in use
+    shimConnect(4);
+    CHECK(!shimAdvertising());
+    CHECK(shimAdvRefused() == 0);
+    shimDisconnect(4);
+    CHECK(shimAdvertising());
+
+    shimDisconnect(1);
+    CHECK(shimWrite(2, fec3ChrHandle, msg, sizeof(msg)) == 0);
+    shimDisconnect(2);
+
+    // FE-C only subscribers don't wake the task up
+    shimClearPdus();
+    shimRunUntil(shimNow() + 2 * SEC);
+    resumes = shimTaskResumes();
+    shimConnect(3);
+    shimSubscribe(3, fec2ChrHandle, true, false);
+    fecTargetPower(msg, 100);
+    CHECK(shimWrite(3, fec3ChrHandle, msg, sizeof(msg)) == 0);
+    shimRunUntil(shimNow() + 60 * SEC);
+    CHECK(shimTaskResumes() - resumes <= 1);
+    CHECK(shimNumPdus() == 0);
+
+    // A 4 hour ride: one wakeup per notification
+    resumes = shimTaskResumes();
+    start = shimNow();
+    shimSubscribe(3, cpsCpmHandle, true, false);
+    shimQuiet(true);
+    shimRunUntil(start + 4 * 3600 * SEC - 1);
+    shimQuiet(false);
+    count = pduCount(3, cpsCpmHandle, &pdu);
+    CHECK(count == 4 * 3600);
+    CHECK(pdu->ts == start + (count - 1) * SEC);
+    CHECK(getSINT16(&pdu->data[2]) == 100);
+    CHECK(shimTaskResumes() - resumes == (uint32_t) count);
+
+    // The write made before subscribing was not charged to the
+    // first notification
+    CHECK(latencyCounts(3, &queued, &hostTx) && (queued == 0));
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s codec|personality|ride\n", argv[0]);
+        return 2;
+    }
+
+    if (strcmp(argv[1], "codec") == 0) {
+        testCodec();
+    } else if (strcmp(argv[1], "personality") == 0) {
+        testPersonality();
+    } else if (strcmp(argv[1], "ride") == 0) {
+        testRide();
+    } else {
+        fprintf(stderr, "unknown test: %s\n", argv[1]);
+        return 2;
+    }
+
+    printf("%s: passed\n", argv[1]);
+    return 0;
+}